@@ -0,0 +1,118 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ARGTOPK_H_
+#define ARGTOPK_H_
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <span>
+#include <stdint.h>
+#include <vector>
+
+#include "fixed-size-priority-queue.h"
+
+namespace fspq_detail {
+
+/// Orders positions of a span by the values there. Equal values rank the
+/// lower position higher, which makes the order total and the result stable.
+template<typename T, typename Compare, typename Index>
+class index_compare
+{
+  public:
+    index_compare(const T *values, const Compare &cmp) : values_(values), cmp_(cmp) {}
+
+    bool operator()(Index a, Index b) const {
+      if (cmp_(values_[a], values_[b]))
+        return true;
+      if (cmp_(values_[b], values_[a]))
+        return false;
+      return a > b;
+    }
+
+  private:
+    const T *values_;
+    [[no_unique_address]] mutable Compare cmp_;
+};
+
+}  // namespace fspq_detail
+
+/// A fixed size priority queue of positions in a span, ordered by the values
+/// they refer to. Only the positions are stored, so the memory is k indices
+/// whatever the size of T; the span must outlive the queue.
+template<typename T, typename Compare = std::less<T>, typename Index = uint32_t>
+class argtopk_queue
+{
+    typedef fspq_detail::index_compare<T, Compare, Index> compare_type;
+
+  public:
+    argtopk_queue(std::span<const T> values, size_t max_size,
+                  const Compare &compare = Compare())
+        : q_(max_size, compare_type(values.data(), compare)) {}
+
+    inline void push(Index i) {
+      q_.push(i);
+    }
+
+    inline void pop() {
+      q_.pop();
+    }
+
+    inline Index top() const {
+      return q_.top();
+    }
+
+    inline const bool empty() const {
+      return q_.empty();
+    }
+
+    inline const size_t size() const {
+      return q_.size();
+    }
+
+    /// Empties the queue, writing the positions to out best first.
+    template<typename OutputIterator>
+    OutputIterator drain(OutputIterator out) {
+      for (; !q_.empty(); q_.pop())
+        *out++ = q_.top();
+      return out;
+    }
+
+  protected:
+    fixed_size_priority_queue<Index, compare_type> q_;
+
+  private:
+    // heap allocation is not allowed
+    void * operator new   (size_t);
+    void * operator new[] (size_t);
+    void   operator delete   (void *);
+    void   operator delete[] (void*);
+};
+
+/// Returns the positions of the k highest values of a span, best first.
+/// Equal values are ranked by position.
+template<typename T, typename Compare = std::less<T>, typename Index = uint32_t>
+std::vector<Index> argtopk(std::span<const T> values, size_t k) {
+  argtopk_queue<T, Compare, Index> q(values, k);
+  for (size_t i = 0; i < values.size(); ++i)
+    q.push(static_cast<Index>(i));
+  std::vector<Index> ranked;
+  ranked.reserve(q.size());
+  q.drain(std::back_inserter(ranked));
+  return ranked;
+}
+
+#endif  // ARGTOPK_H_
@@ -0,0 +1,186 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ASYNC_FIXED_SIZE_PRIORITY_QUEUE_H_
+#define ASYNC_FIXED_SIZE_PRIORITY_QUEUE_H_
+
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "fixed-size-priority-queue.h"
+
+/// A fixed size priority queue that any thread can push to, read by one
+/// consumer coroutine which suspends until there is something to read.
+///
+/// The consumer awaits next_batch(n), which resumes once n elements were
+/// pushed since the last batch, or on flush() or close(), and yields the
+/// queued elements best first, emptying the queue. The coroutine is resumed
+/// on the thread whose push, flush or close made the batch ready, so waiting
+/// takes neither a thread nor polling. For element-wise reading,
+///
+///   stream s = q.drain_async(n);
+///   while (std::optional<T> x = co_await s.next()) ...
+///
+/// reads batch after batch until the queue is closed.
+template<typename T, typename Compare = std::less<T> >
+class async_fixed_size_priority_queue
+{
+  public:
+    explicit async_fixed_size_priority_queue(size_t max_size, const Compare &compare = Compare())
+        : q_(max_size, compare), pushed_(0), wanted_(0), flushed_(false), closed_(false) {}
+
+    inline void push(const T &x) {
+      std::unique_lock<std::mutex> guard(lock_);
+      q_.push(x);
+      ++pushed_;
+      wake(guard);
+    }
+
+    /// Makes a batch ready even if fewer elements than asked for arrived.
+    /// A flush with none at all is ignored, rather than cutting short the
+    /// batch of the next push.
+    inline void flush() {
+      std::unique_lock<std::mutex> guard(lock_);
+      if (q_.empty())
+        return;
+      flushed_ = true;
+      wake(guard);
+    }
+
+    /// Ends the stream. Batches after the last elements are empty.
+    inline void close() {
+      std::unique_lock<std::mutex> guard(lock_);
+      closed_ = true;
+      wake(guard);
+    }
+
+    /// Awaitable for the next batch; see the class comment.
+    class batch_awaiter
+    {
+      public:
+        batch_awaiter(async_fixed_size_priority_queue &q, size_t n) : q_(&q), n_(n) {}
+
+        bool await_ready() const { return false; }
+
+        bool await_suspend(std::coroutine_handle<> consumer) {
+          std::lock_guard<std::mutex> guard(q_->lock_);
+          q_->wanted_ = n_;
+          if (q_->ready())
+            return false;
+          q_->consumer_ = consumer;
+          return true;
+        }
+
+        std::vector<T> await_resume() {
+          std::lock_guard<std::mutex> guard(q_->lock_);
+          return q_->take_batch();
+        }
+
+      private:
+        async_fixed_size_priority_queue *q_;
+        size_t n_;
+    };
+
+    inline batch_awaiter next_batch(size_t n) {
+      return batch_awaiter(*this, n);
+    }
+
+    /// Element-wise reading of batches of n; see the class comment.
+    class stream
+    {
+      public:
+        class next_awaiter
+        {
+          public:
+            explicit next_awaiter(stream &s) : s_(&s), batch_(*s.q_, s.n_) {}
+
+            bool await_ready() const { return s_->pos_ < s_->batch_.size(); }
+
+            bool await_suspend(std::coroutine_handle<> consumer) {
+              return batch_.await_suspend(consumer);
+            }
+
+            std::optional<T> await_resume() {
+              if (s_->pos_ == s_->batch_.size()) {
+                s_->batch_ = batch_.await_resume();
+                s_->pos_ = 0;
+                if (s_->batch_.empty())
+                  return std::nullopt;
+              }
+              return s_->batch_[s_->pos_++];
+            }
+
+          private:
+            stream *s_;
+            batch_awaiter batch_;
+        };
+
+        stream(async_fixed_size_priority_queue &q, size_t n) : q_(&q), n_(n), pos_(0) {}
+
+        /// Awaits the next element, or std::nullopt once the queue is closed
+        /// and empty.
+        inline next_awaiter next() {
+          return next_awaiter(*this);
+        }
+
+      private:
+        async_fixed_size_priority_queue *q_;
+        size_t n_;
+        std::vector<T> batch_;
+        size_t pos_;
+    };
+
+    inline stream drain_async(size_t n) {
+      return stream(*this, n);
+    }
+
+  protected:
+    inline bool ready() const {
+      return pushed_ >= wanted_ || (flushed_ && !q_.empty()) || closed_;
+    }
+
+    /// Resumes the waiting consumer if its batch is ready, after unlocking.
+    inline void wake(std::unique_lock<std::mutex> &guard) {
+      if (!consumer_ || !ready())
+        return;
+      std::coroutine_handle<> consumer = consumer_;
+      consumer_ = nullptr;
+      guard.unlock();
+      consumer.resume();
+    }
+
+    inline std::vector<T> take_batch() {
+      std::vector<T> batch;
+      batch.reserve(q_.size());
+      for (; !q_.empty(); q_.pop())
+        batch.push_back(q_.top());
+      pushed_ = 0;
+      flushed_ = false;
+      return batch;
+    }
+
+    fixed_size_priority_queue<T, Compare> q_;
+    std::mutex lock_;
+    std::coroutine_handle<> consumer_;
+    size_t pushed_;
+    size_t wanted_;
+    bool flushed_;
+    bool closed_;
+};
+
+#endif  // ASYNC_FIXED_SIZE_PRIORITY_QUEUE_H_
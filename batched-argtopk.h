@@ -0,0 +1,153 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BATCHED_ARGTOPK_H_
+#define BATCHED_ARGTOPK_H_
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <stdint.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "packed-score-id-priority-queue.h"
+
+namespace fspq_detail {
+
+/// Scores are scanned in blocks of this many columns; a block is only looked
+/// at element by element when one of them beats the current threshold.
+const size_t argtopk_block = 16;
+
+/// Matrix elements per thread below which batched_argtopk starts no more
+/// threads.
+const size_t argtopk_min_elements_per_thread = 1 << 16;
+
+inline void argtopk_rows(packed_score_id_priority_queue &q, const float *data,
+                         size_t first_row, size_t last_row, size_t cols, size_t k,
+                         uint32_t *out_ids, float *out_scores) {
+  // The scratch queue is reused across rows and calls. Ids are stored
+  // inverted so that ties go to the lower column.
+  q.set_max_size(k);
+  size_t head = std::min(k, cols);
+  for (size_t row = first_row; row < last_row; ++row) {
+    const float *x = data + row * cols;
+    for (size_t j = 0; j < head; ++j)
+      q.push(x[j], ~static_cast<uint32_t>(j));
+    size_t j = head;
+    if (k > 0 && j < cols) {
+      float threshold = q.bottom().first;
+      for (; j + argtopk_block <= cols; j += argtopk_block) {
+        // An integer or-reduction of the comparisons, which vectorizes
+        // without relaxing float semantics.
+        int hits = 0;
+        for (size_t b = 0; b < argtopk_block; ++b)
+          hits |= x[j + b] > threshold;
+        if (!hits)
+          continue;
+        for (size_t b = 0; b < argtopk_block; ++b) {
+          if (x[j + b] > threshold) {
+            q.push(x[j + b], ~static_cast<uint32_t>(j + b));
+            threshold = q.bottom().first;
+          }
+        }
+      }
+      for (; j < cols; ++j) {
+        if (x[j] > threshold) {
+          q.push(x[j], ~static_cast<uint32_t>(j));
+          threshold = q.bottom().first;
+        }
+      }
+    }
+    uint32_t *ids = out_ids + row * k;
+    float *scores = out_scores + row * k;
+    size_t i = 0;
+    for (; !q.empty(); ++i, q.pop()) {
+      ids[i] = ~q.top().second;
+      scores[i] = q.top().first;
+    }
+    for (; i < k; ++i) {
+      ids[i] = std::numeric_limits<uint32_t>::max();
+      scores[i] = -std::numeric_limits<float>::infinity();
+    }
+  }
+}
+
+}  // namespace fspq_detail
+
+/// Scratch queues for batched_argtopk, one per thread, which keep their
+/// memory from one call to the next. Only the queues persist: the threads
+/// themselves are started and joined by every call.
+class batched_argtopk_scratch
+{
+  public:
+    /// Makes sure there is a queue for each of num_threads threads.
+    inline void reserve(size_t num_threads) {
+      if (queues_.size() < num_threads)
+        queues_.resize(num_threads);
+    }
+
+    inline packed_score_id_priority_queue &queue(size_t thread) {
+      return queues_[thread];
+    }
+
+  private:
+    std::vector<packed_score_id_priority_queue> queues_;
+};
+
+/// Finds the k highest scores of every row of a row-major rows x cols
+/// matrix. For each row, out_ids and out_scores receive k entries, best
+/// first; ties go to the lower column, and rows shorter than k are padded
+/// with id UINT32_MAX and score -inf. Rows are split across num_threads
+/// threads (0 for one per core) when the matrix is large enough. Thread i
+/// keeps its rows' candidates in scratch.queue(i), so callers that run many
+/// batches pass the same scratch to every call.
+inline void batched_argtopk(const float *data, size_t rows, size_t cols, size_t k,
+                            uint32_t *out_ids, float *out_scores,
+                            batched_argtopk_scratch &scratch, size_t num_threads = 0) {
+  if (num_threads == 0)
+    num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  size_t by_size = rows * cols / fspq_detail::argtopk_min_elements_per_thread;
+  num_threads = std::max<size_t>(std::min(std::min(num_threads, by_size), rows), 1);
+  scratch.reserve(num_threads);
+  if (num_threads == 1) {
+    fspq_detail::argtopk_rows(scratch.queue(0), data, 0, rows, cols, k,
+                              out_ids, out_scores);
+    return;
+  }
+  std::vector<std::thread> threads;
+  size_t chunk = (rows + num_threads - 1) / num_threads;
+  for (size_t first = chunk; first < rows; first += chunk) {
+    threads.push_back(std::thread(fspq_detail::argtopk_rows,
+                                  std::ref(scratch.queue(threads.size() + 1)), data, first,
+                                  std::min(first + chunk, rows), cols, k,
+                                  out_ids, out_scores));
+  }
+  fspq_detail::argtopk_rows(scratch.queue(0), data, 0, std::min(chunk, rows), cols, k,
+                            out_ids, out_scores);
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+}
+
+/// Same as above, with scratch queues owned by the calling thread, so that
+/// repeated calls from one thread reuse them.
+inline void batched_argtopk(const float *data, size_t rows, size_t cols, size_t k,
+                            uint32_t *out_ids, float *out_scores, size_t num_threads = 0) {
+  static thread_local batched_argtopk_scratch scratch;
+  batched_argtopk(data, rows, cols, k, out_ids, out_scores, scratch, num_threads);
+}
+
+#endif  // BATCHED_ARGTOPK_H_
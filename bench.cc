@@ -0,0 +1,463 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include "batched-argtopk.h"
+#include "blocked-fixed-size-priority-queue.h"
+#include "concurrent-fixed-size-priority-queue.h"
+#include "fixed-size-priority-queue.h"
+#include "fixed-size-priority-queue-pool.h"
+#include "running-quantile.h"
+#include "weighted-reservoir.h"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <thread>
+using namespace std;
+
+template<size_t Bytes>
+struct Payload {
+  float score;
+  char pad[Bytes - sizeof(float)];
+  bool operator< (const Payload &other) const { return score < other.score; }
+};
+
+template<>
+struct Payload<4> {
+  float score;
+  bool operator< (const Payload &other) const { return score < other.score; }
+};
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static volatile float sink;
+
+/// Fills a queue of capacity k and drains it again, in nanoseconds per
+/// element. Filling is sift-up bound, draining sift-down bound.
+template<typename T, size_t Arity>
+double fill_and_drain(size_t k, const vector<float> &scores) {
+  fixed_size_priority_queue<T, less<T>, Arity> q(k);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  T x = T();
+  for (size_t i = 0; i < k; ++i) {
+    x.score = scores[i];
+    q.push(x);
+  }
+  float sum = 0;
+  while (!q.empty()) {
+    sum += q.top().score;
+    q.pop();
+  }
+  sink = sum;
+  return seconds_since(start) * 1e9 / k;
+}
+
+template<typename Queue>
+double fill_and_drain(Queue &q, size_t k, const vector<float> &scores) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  typename iterator_traits<typename Queue::iterator>::value_type x;
+  for (size_t i = 0; i < k; ++i) {
+    x.score = scores[i];
+    q.push(x);
+  }
+  float sum = 0;
+  while (!q.empty()) {
+    sum += q.top().score;
+    q.pop();
+  }
+  sink = sum;
+  return seconds_since(start) * 1e9 / k;
+}
+
+/// Fills a queue of capacity k, then streams rising scores into it so that
+/// every push replaces the minimum, in nanoseconds per streamed push. The
+/// first replacement, which finds the minimum, is not timed.
+template<typename Queue>
+double replace_stream(Queue &q, size_t k) {
+  typename iterator_traits<typename Queue::iterator>::value_type x;
+  for (size_t i = 0; i <= k; ++i) {
+    x.score = static_cast<float>(i);
+    q.push(x);
+  }
+  size_t n = max<size_t>(100, 100000000 / k);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (size_t i = 1; i <= n; ++i) {
+    x.score = static_cast<float>(k + i);
+    q.push(x);
+  }
+  double ns = seconds_since(start) * 1e9 / n;
+  sink = q.top().score;
+  return ns;
+}
+
+template<size_t Bytes>
+void bench_arity() {
+  printf("arity, element size %zu bytes (ns per element, fill + drain)\n", Bytes);
+  printf("%10s %10s %10s %10s\n", "k", "d=2", "d=4", "d=8");
+  mt19937 gen(42);
+  uniform_real_distribution<float> dist(0, 1);
+  for (size_t k = 1000; k <= 1000000; k *= 10) {
+    vector<float> scores(k);
+    for (size_t i = 0; i < k; ++i)
+      scores[i] = dist(gen);
+    printf("%10zu %10.1f %10.1f %10.1f\n", k,
+           fill_and_drain<Payload<Bytes>, 2>(k, scores),
+           fill_and_drain<Payload<Bytes>, 4>(k, scores),
+           fill_and_drain<Payload<Bytes>, 8>(k, scores));
+  }
+  printf("\n");
+
+  printf("arity, element size %zu bytes (ns per push, stream into a full queue)\n", Bytes);
+  printf("%10s %10s %10s %10s\n", "k", "d=2", "d=4", "d=8");
+  for (size_t k = 1000; k <= 1000000; k *= 10) {
+    fixed_size_priority_queue<Payload<Bytes>, less<Payload<Bytes> >, 2> q2(k);
+    fixed_size_priority_queue<Payload<Bytes>, less<Payload<Bytes> >, 4> q4(k);
+    fixed_size_priority_queue<Payload<Bytes>, less<Payload<Bytes> >, 8> q8(k);
+    printf("%10zu %10.1f %10.1f %10.1f\n", k,
+           replace_stream(q2, k), replace_stream(q4, k), replace_stream(q8, k));
+  }
+  printf("\n");
+}
+
+void bench_blocked() {
+  typedef Payload<4> T;
+  printf("blocked layout, 4 byte elements (ns per element, fill + drain)\n");
+  printf("%10s %10s %10s %10s %10s\n", "k", "binary", "line", "page", "huge page");
+  mt19937 gen(42);
+  uniform_real_distribution<float> dist(0, 1);
+  for (size_t k = 10000; k <= 10000000; k *= 10) {
+    vector<float> scores(k);
+    for (size_t i = 0; i < k; ++i)
+      scores[i] = dist(gen);
+    fixed_size_priority_queue<T> q_binary(k);
+    blocked_fixed_size_priority_queue<T, less<T>, 64> q_line(k);
+    blocked_fixed_size_priority_queue<T, less<T>, 4096> q_page(k);
+    blocked_fixed_size_priority_queue<T, less<T>, 4096, huge_page_allocator<T> > q_huge(k);
+    printf("%10zu %10.1f %10.1f %10.1f %10.1f\n", k,
+           fill_and_drain(q_binary, k, scores), fill_and_drain(q_line, k, scores),
+           fill_and_drain(q_page, k, scores), fill_and_drain(q_huge, k, scores));
+  }
+  printf("\n");
+
+  printf("blocked layout, 4 byte elements (ns per push, stream into a full queue)\n");
+  printf("%10s %10s %10s %10s %10s\n", "k", "binary", "line", "page", "huge page");
+  for (size_t k = 10000; k <= 1000000; k *= 10) {
+    fixed_size_priority_queue<T> q_binary(k);
+    blocked_fixed_size_priority_queue<T, less<T>, 64> q_line(k);
+    blocked_fixed_size_priority_queue<T, less<T>, 4096> q_page(k);
+    blocked_fixed_size_priority_queue<T, less<T>, 4096, huge_page_allocator<T> > q_huge(k);
+    printf("%10zu %10.1f %10.1f %10.1f %10.1f\n", k,
+           replace_stream(q_binary, k), replace_stream(q_line, k),
+           replace_stream(q_page, k), replace_stream(q_huge, k));
+  }
+  printf("\n");
+}
+
+void bench_lazy() {
+  printf("lazy mode, stream of 2e6 floats (ns per push, including the final read)\n");
+  printf("%10s %10s %10s\n", "k", "eager", "lazy");
+  mt19937 gen(42);
+  uniform_real_distribution<float> dist(0, 1);
+  size_t n = 2000000;
+  vector<float> scores(n);
+  for (size_t i = 0; i < n; ++i)
+    scores[i] = dist(gen);
+  for (size_t k = 10; k <= 10000; k *= 10) {
+    double ns[2];
+    for (int lazy = 0; lazy < 2; ++lazy) {
+      fixed_size_priority_queue<float> q(k);
+      q.set_lazy(lazy);
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      for (size_t i = 0; i < n; ++i)
+        q.push(scores[i]);
+      sink = q.top();
+      ns[lazy] = seconds_since(start) * 1e9 / n;
+    }
+    printf("%10zu %10.1f %10.1f\n", k, ns[0], ns[1]);
+  }
+  printf("\n");
+}
+
+/// Builds a fresh queue of capacity k for every group of 2k scores, as for
+/// many short lived queues, in nanoseconds per queue.
+template<typename Queue>
+double many_small(size_t k, const vector<float> &scores) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  float sum = 0;
+  size_t n_queues = scores.size() / (2 * k);
+  for (size_t i = 0; i < n_queues; ++i) {
+    Queue q(k);
+    for (size_t j = 0; j < 2 * k; ++j)
+      q.push(scores[2 * k * i + j]);
+    sum += q.top();
+  }
+  sink = sum;
+  return seconds_since(start) * 1e9 / n_queues;
+}
+
+void bench_inline() {
+  printf("inline storage of 8 floats, 2 * k pushes per queue (ns per queue)\n");
+  printf("%10s %10s %10s\n", "k", "vector", "inline");
+  mt19937 gen(42);
+  uniform_real_distribution<float> dist(0, 1);
+  vector<float> scores(1 << 22);
+  for (size_t i = 0; i < scores.size(); ++i)
+    scores[i] = dist(gen);
+  for (size_t k = 2; k <= 32; k *= 2) {
+    printf("%10zu %10.1f %10.1f\n", k,
+           many_small<fixed_size_priority_queue<float> >(k, scores),
+           many_small<fixed_size_priority_queue<float, less<float>, 2, identity, 8> >(k, scores));
+  }
+  printf("\n");
+}
+
+void bench_pool() {
+  size_t num_queues = 256, n = 4000000;
+  printf("%zu queues, %zu pushes to random queues (ns per push)\n", num_queues, n);
+  printf("%10s %10s %10s\n", "k", "separate", "pool");
+  mt19937 gen(42);
+  uniform_real_distribution<float> dist(0, 1);
+  vector<float> scores(n);
+  vector<uint32_t> queues(n);
+  for (size_t i = 0; i < n; ++i) {
+    scores[i] = dist(gen);
+    queues[i] = gen() % num_queues;
+  }
+  for (size_t k = 4; k <= 256; k *= 4) {
+    vector<fixed_size_priority_queue<float> > separate(num_queues, fixed_size_priority_queue<float>(k));
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i)
+      separate[queues[i]].push(scores[i]);
+    float sum = 0;
+    for (size_t q = 0; q < num_queues; ++q)
+      sum += separate[q].top();
+    double ns_separate = seconds_since(start) * 1e9 / n;
+
+    fixed_size_priority_queue_pool<float> pool(num_queues, k);
+    start = chrono::steady_clock::now();
+    pool.push(scores.begin(), scores.end(), queues.begin());
+    for (size_t q = 0; q < num_queues; ++q)
+      sum += pool.top(q);
+    sink = sum;
+    printf("%10zu %10.1f %10.1f\n", k, ns_separate, seconds_since(start) * 1e9 / n);
+  }
+  printf("\n");
+}
+
+/// A single queue behind a mutex, for comparison with the MultiQueue.
+class locked_queue
+{
+  public:
+    explicit locked_queue(size_t max_size) : q_(max_size) {}
+    void push(float x) {
+      lock_guard<mutex> guard(lock_);
+      q_.push(x);
+    }
+    bool try_pop(float &x) {
+      lock_guard<mutex> guard(lock_);
+      if (q_.empty())
+        return false;
+      x = q_.top();
+      q_.pop();
+      return true;
+    }
+
+  private:
+    mutex lock_;
+    fixed_size_priority_queue<float> q_;
+};
+
+/// Each of num_threads threads alternates push and try_pop, in nanoseconds
+/// per operation over all threads.
+template<typename Queue>
+double push_pop_threads(Queue &q, size_t num_threads, size_t ops_per_thread) {
+  for (size_t i = 0; i < 10000; ++i)
+    q.push(static_cast<float>(i));
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.push_back(thread([&q, t, ops_per_thread]() {
+      mt19937 gen(t);
+      uniform_real_distribution<float> dist(0, 10000);
+      float x;
+      for (size_t i = 0; i < ops_per_thread; i += 2) {
+        q.push(dist(gen));
+        q.try_pop(x);
+      }
+    }));
+  }
+  for (size_t t = 0; t < num_threads; ++t)
+    threads[t].join();
+  return seconds_since(start) * 1e9 / (num_threads * ops_per_thread);
+}
+
+void bench_multi() {
+  size_t ops = 1000000;
+  printf("MultiQueue vs one locked queue, push + try_pop per thread (ns per op)\n");
+  printf("%10s %10s %10s\n", "threads", "locked", "multi");
+  size_t max_threads = max<size_t>(thread::hardware_concurrency(), 4);
+  for (size_t p = 1; p <= max_threads; p *= 2) {
+    locked_queue q_locked(1000000);
+    multi_fixed_size_priority_queue<float> q_multi(1000000, p);
+    double ns_locked = push_pop_threads(q_locked, p, ops);
+    printf("%10zu %10.1f %10.1f\n", p, ns_locked, push_pop_threads(q_multi, p, ops));
+  }
+
+  // Rank error: how many queued elements rank above each popped one. The
+  // values are a permutation of 0 .. n - 1, and a Fenwick tree over them
+  // counts the ones still queued.
+  size_t n = 100000, pops = 10000;
+  vector<int> values(n);
+  for (size_t i = 0; i < n; ++i)
+    values[i] = i;
+  shuffle(values.begin(), values.end(), mt19937(42));
+  printf("%10s %10s %10s\n", "shards", "mean rank", "max rank");
+  for (size_t shards = 2; shards <= 64; shards *= 4) {
+    multi_fixed_size_priority_queue<int> q(n, shards / 2, 2);
+    vector<int> tree(n + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+      q.push(values[i]);
+      for (size_t j = values[i] + 1; j <= n; j += j & -j)
+        ++tree[j];
+    }
+    double sum = 0;
+    int max_rank = 0, x;
+    for (size_t i = 0; i < pops && q.try_pop(x); ++i) {
+      for (size_t j = x + 1; j <= n; j += j & -j)
+        --tree[j];
+      int below = 0;
+      for (size_t j = x + 1; j > 0; j -= j & -j)
+        below += tree[j];
+      int queued = n - i - 1;
+      int rank = queued - below;
+      sum += rank;
+      max_rank = max(max_rank, rank);
+    }
+    printf("%10zu %10.1f %10d\n", q.num_shards(), sum / pops, max_rank);
+  }
+  printf("\n");
+}
+
+void bench_reservoir() {
+  size_t n = 50000000;
+  printf("weighted reservoir of 100 from %zu items (ns per item)\n", n);
+  mt19937 gen(42);
+  uniform_real_distribution<float> dist(0.5, 2);
+  vector<float> weights(n);
+  for (size_t i = 0; i < n; ++i)
+    weights[i] = dist(gen);
+  vector<uint32_t> items(n);
+  for (size_t i = 0; i < n; ++i)
+    items[i] = i;
+
+  // A-Res: a key for every item.
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  fixed_size_priority_queue<pair<double, uint32_t> > q(100);
+  uniform_real_distribution<double> uniform(0, 1);
+  for (size_t i = 0; i < n; ++i)
+    q.push(make_pair(log(uniform(gen)) / weights[i], items[i]));
+  sink = q.top().first;
+  printf("%24s %10.2f\n", "key per item", seconds_since(start) * 1e9 / n);
+
+  start = chrono::steady_clock::now();
+  weighted_reservoir<uint32_t, 100> reservoir;
+  reservoir.push(items.begin(), items.end(), weights.begin());
+  sink = reservoir.size();
+  printf("%24s %10.2f\n", "exponential jumps", seconds_since(start) * 1e9 / n);
+  printf("\n");
+}
+
+void bench_running_quantile() {
+  printf("p99 of a sliding window (ns per event)\n");
+  printf("%10s %10s %10s\n", "window", "sort", "dual heap");
+  mt19937 gen(42);
+  exponential_distribution<float> dist(1);
+  vector<float> latencies(1000000);
+  for (size_t i = 0; i < latencies.size(); ++i)
+    latencies[i] = dist(gen);
+  for (size_t window = 100; window <= 100000; window *= 10) {
+    // Sorting a copy of the full window per event, for fewer events.
+    size_t n_sorted = min<size_t>(latencies.size() - window, 2e8 / window);
+    vector<float> sorted;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    float sum = 0;
+    for (size_t i = 0; i < n_sorted; ++i) {
+      sorted.assign(latencies.begin() + i, latencies.begin() + i + window);
+      sort(sorted.begin(), sorted.end());
+      sum += sorted[static_cast<size_t>(0.99 * (sorted.size() - 1))];
+    }
+    double ns_sort = seconds_since(start) * 1e9 / n_sorted;
+
+    running_quantile<float> p99(window, 0.99);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < latencies.size(); ++i) {
+      p99.push(latencies[i]);
+      sum += p99.quantile();
+    }
+    sink = sum;
+    printf("%10zu %10.1f %10.1f\n", window, ns_sort, seconds_since(start) * 1e9 / latencies.size());
+  }
+  printf("\n");
+}
+
+void bench_batched_argtopk() {
+  size_t rows = 1000, cols = 32000, k = 10;
+  printf("batched argtopk, %zu x %zu, k = %zu (ms per matrix)\n", rows, cols, k);
+  mt19937 gen(42);
+  normal_distribution<float> dist(0, 1);
+  vector<float> data(rows * cols);
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = dist(gen);
+  vector<uint32_t> ids(rows * k);
+  vector<float> scores(rows * k);
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<uint32_t> order(cols);
+  for (size_t row = 0; row < rows; ++row) {
+    const float *x = &data[row * cols];
+    for (size_t j = 0; j < cols; ++j)
+      order[j] = j;
+    partial_sort(order.begin(), order.begin() + k, order.end(),
+                 [x](uint32_t a, uint32_t b) { return x[a] > x[b]; });
+    copy(order.begin(), order.begin() + k, ids.begin() + row * k);
+  }
+  printf("%24s %10.1f\n", "partial_sort per row", seconds_since(start) * 1e3);
+
+  start = chrono::steady_clock::now();
+  batched_argtopk(data.data(), rows, cols, k, ids.data(), scores.data(), 1);
+  printf("%24s %10.1f\n", "1 thread", seconds_since(start) * 1e3);
+
+  start = chrono::steady_clock::now();
+  batched_argtopk(data.data(), rows, cols, k, ids.data(), scores.data());
+  printf("%24s %10.1f\n", "all cores", seconds_since(start) * 1e3);
+  printf("\n");
+}
+
+int main(int argc, char const *argv[]) {
+  bench_arity<4>();
+  bench_arity<16>();
+  bench_arity<64>();
+  bench_blocked();
+  bench_lazy();
+  bench_inline();
+  bench_pool();
+  bench_multi();
+  bench_reservoir();
+  bench_running_quantile();
+  bench_batched_argtopk();
+}
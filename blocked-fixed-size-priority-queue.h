@@ -0,0 +1,406 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLOCKED_FIXED_SIZE_PRIORITY_QUEUE_H_
+#define BLOCKED_FIXED_SIZE_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "fixed-size-priority-queue.h"
+
+namespace fspq_detail {
+
+/// The largest power of two not above n, and at least 4.
+constexpr size_t block_slots_for(size_t n) {
+  size_t slots = 4;
+  while (slots <= n / 2)
+    slots *= 2;
+  return slots;
+}
+
+/// Allocator returning memory aligned to Alignment bytes.
+template<typename T, size_t Alignment>
+class aligned_allocator
+{
+  public:
+    typedef T value_type;
+    template<typename U> struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+    aligned_allocator() {}
+    template<typename U> aligned_allocator(const aligned_allocator<U, Alignment> &) {}
+
+    T *allocate(size_t n) {
+      return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T *p, size_t) {
+      ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template<typename U>
+    bool operator==(const aligned_allocator<U, Alignment> &) const { return true; }
+    template<typename U>
+    bool operator!=(const aligned_allocator<U, Alignment> &) const { return false; }
+};
+
+}  // namespace fspq_detail
+
+/// Allocator for very large queues which asks the kernel to back the memory
+/// with transparent huge pages, so that the whole heap is covered by a
+/// handful of TLB entries. Elsewhere it falls back to page aligned memory.
+template<typename T>
+class huge_page_allocator
+{
+  public:
+    typedef T value_type;
+    template<typename U> struct rebind { typedef huge_page_allocator<U> other; };
+
+    static const size_t huge_page_size = 2 << 20;
+
+    huge_page_allocator() {}
+    template<typename U> huge_page_allocator(const huge_page_allocator<U> &) {}
+
+    T *allocate(size_t n) {
+#ifdef __linux__
+      void *p = mmap(NULL, round_up(n * sizeof(T)), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc();
+      madvise(p, round_up(n * sizeof(T)), MADV_HUGEPAGE);
+      return static_cast<T *>(p);
+#else
+      return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(4096)));
+#endif
+    }
+
+    void deallocate(T *p, size_t n) {
+#ifdef __linux__
+      munmap(p, round_up(n * sizeof(T)));
+#else
+      ::operator delete(p, std::align_val_t(4096));
+#endif
+    }
+
+    template<typename U>
+    bool operator==(const huge_page_allocator<U> &) const { return true; }
+    template<typename U>
+    bool operator!=(const huge_page_allocator<U> &) const { return false; }
+
+  private:
+    static size_t round_up(size_t bytes) {
+      return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    }
+};
+
+/// A fixed size priority queue for very large sizes, using a blocked heap
+/// layout. The binary heap is cut into subtrees of log2(S) levels, and each
+/// subtree is stored in its own aligned block of S slots, S being the largest
+/// power of two (at least 4) for which a block fits in BlockBytes (a cache
+/// line or a page). A path from the root to a leaf then touches one block
+/// per log2(S) levels instead of one cache line or page per level.
+///
+/// Slot 0 of each block is unused, slots 1 .. S - 1 hold the subtree as a
+/// 1-based binary heap. The S / 2 bottom nodes of a block have their children
+/// at the roots of the child blocks b * S + 1 ... b * S + S. T needs to be
+/// default constructible, since the whole storage is allocated up front.
+///
+/// A full queue keeps its minimum as a threshold, so rejecting an element
+/// takes one comparison. As in fixed_size_priority_queue, a tournament tree
+/// over the leaves finds the next minimum after a replacement in O(log k).
+template<typename T, typename Compare = std::less<T>, size_t BlockBytes = 4096,
+         typename Allocator = fspq_detail::aligned_allocator<T, BlockBytes> >
+class blocked_fixed_size_priority_queue
+{
+  public:
+    static const size_t block_slots = fspq_detail::block_slots_for(BlockBytes / sizeof(T));
+
+    blocked_fixed_size_priority_queue()
+        : size_(0), max_size_(0), has_threshold_(false), threshold_index_(0),
+          has_leaf_tree_(false) {}
+    blocked_fixed_size_priority_queue(size_t max_size)
+        : size_(0), max_size_(max_size), has_threshold_(false), threshold_index_(0),
+          has_leaf_tree_(false) {
+      reserve_slots(max_size);
+    }
+    blocked_fixed_size_priority_queue(size_t max_size, const Compare &compare)
+        : size_(0), max_size_(max_size), has_threshold_(false), threshold_index_(0),
+          has_leaf_tree_(false), cmp(compare) {
+      reserve_slots(max_size);
+    }
+
+    /// Iterates over the elements in block order.
+    class iterator
+    {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef T* pointer;
+        typedef T& reference;
+
+        iterator(blocked_fixed_size_priority_queue *q, size_t i) : q_(q), i_(i) {}
+        reference operator*() const { return q_->at(i_); }
+        pointer operator->() const { return &**this; }
+        iterator &operator++() { ++i_; return *this; }
+        iterator operator++(int) { iterator it = *this; ++i_; return it; }
+        bool operator==(const iterator &other) const { return i_ == other.i_; }
+        bool operator!=(const iterator &other) const { return i_ != other.i_; }
+
+      private:
+        blocked_fixed_size_priority_queue *q_;
+        size_t i_;
+    };
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, size_); }
+
+    inline void push(const T &x) {
+      if (size_ == max_size_) {
+        if (size_ == 0)
+          return;
+        // As in fixed_size_priority_queue, the minimum is kept until it gets
+        // replaced, so that rejecting an element takes one comparison.
+        if (!has_threshold_)
+          find_threshold();
+        if (cmp(at(threshold_index_), x)) {
+          at(threshold_index_) = x;
+          sift_up(threshold_index_);
+          replaced_leaf();
+        }
+      }
+      else {
+        at(size_) = x;
+        sift_up(size_++);
+        forget_threshold();
+      }
+    }
+
+    inline void pop() {
+      if (size_ == 0)
+        return;
+      --size_;
+      forget_threshold();
+      if (size_ > 0) {
+        at(0) = std::move(at(size_));
+        sift_down(0);
+      }
+    }
+
+    inline const T& top() const {
+      return at(0);
+    }
+
+    inline const bool empty() const {
+      return size_ == 0;
+    }
+
+    inline const size_t size() const {
+      return size_;
+    }
+
+    inline void enlarge_max_size(size_t max_size) {
+      if (max_size_ < max_size) {
+        max_size_ = max_size;
+        reserve_slots(max_size);
+      }
+    }
+
+  protected:
+    // Elements are numbered 0 .. size_ - 1 block by block, which keeps every
+    // prefix of the numbering a valid heap shape.
+    static const size_t block_elems = block_slots - 1;
+    static const size_t half = block_slots / 2;
+
+    static size_t slot(size_t i) {
+      return i / block_elems * block_slots + i % block_elems + 1;
+    }
+
+    T &at(size_t i) { return c_[slot(i)]; }
+    const T &at(size_t i) const { return c_[slot(i)]; }
+
+    // The heap walks work on slots, where all the index arithmetic is by
+    // powers of two.
+    static size_t parent_slot(size_t p) {
+      size_t block = p / block_slots, local = p % block_slots;
+      if (local > 1)
+        return block * block_slots + local / 2;
+      size_t parent_block = (block - 1) / block_slots;
+      size_t leaf = (block - 1) % block_slots / 2;
+      return parent_block * block_slots + half + leaf;
+    }
+
+    // The children of slot p are first_child_slot(p) and second_child_slot(p).
+    static size_t first_child_slot(size_t p) {
+      size_t block = p / block_slots, local = p % block_slots;
+      if (local < half)
+        return block * block_slots + 2 * local;
+      return (block * block_slots + 2 * (local - half) + 1) * block_slots + 1;
+    }
+    static size_t second_child_slot(size_t p) {
+      size_t block = p / block_slots, local = p % block_slots;
+      if (local < half)
+        return block * block_slots + 2 * local + 1;
+      return (block * block_slots + 2 * (local - half) + 2) * block_slots + 1;
+    }
+
+    void sift_up(size_t i) {
+      size_t p = slot(i);
+      T x = std::move(c_[p]);
+      while (p > 1) {
+        size_t parent = parent_slot(p);
+        if (!cmp(c_[parent], x))
+          break;
+        c_[p] = std::move(c_[parent]);
+        p = parent;
+      }
+      c_[p] = std::move(x);
+    }
+
+    void sift_down(size_t i) {
+      size_t p = slot(i), end = slot(size_);
+      T x = std::move(c_[p]);
+      for (size_t child = first_child_slot(p); child < end; child = first_child_slot(p)) {
+        size_t other = second_child_slot(p);
+        if (other < end && cmp(c_[child], c_[other]))
+          child = other;
+        if (!cmp(x, c_[child]))
+          break;
+        c_[p] = std::move(c_[child]);
+        p = child;
+      }
+      c_[p] = std::move(x);
+    }
+
+    /// Calls f(first, last) for the ranges of nodes without children: the
+    /// tail of the last block, plus the bottom halves of the blocks whose
+    /// child blocks are empty.
+    template<typename F>
+    void for_each_leaf_range(F f) const {
+      size_t last = (size_ - 1) / block_elems;
+      size_t in_last = size_ - last * block_elems;
+      f(last * block_elems + in_last / 2, last * block_elems + in_last);
+      if (last == 0)
+        return;
+      size_t lowest_parent = (last - 1) / block_slots;
+      size_t r = last - lowest_parent * block_slots;
+      f(lowest_parent * block_elems + half + (r + 1) / 2 - 1,
+        (lowest_parent + 1) * block_elems);
+      for (size_t block = lowest_parent + 1; block < last; ++block)
+        f(block * block_elems + half - 1, (block + 1) * block_elems);
+    }
+
+    /// Returns the lowest element, searching only the leaves.
+    size_t min_leaf() const {
+      size_t best = size_ - 1;
+      for_each_leaf_range([&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+          if (cmp(at(i), at(best)))
+            best = i;
+        }
+      });
+      return best;
+    }
+
+    void forget_threshold() {
+      has_threshold_ = false;
+      has_leaf_tree_ = false;
+    }
+
+    /// Makes the minimum of a full queue the threshold. Large queues build a
+    /// tournament tree over their leaves for it: leaf_tree_[p] holds the
+    /// element index of the lower leaf of its children 2p and 2p + 1, the
+    /// leaves themselves are at n_leaves and up, and the root is leaf_tree_[1].
+    void find_threshold() {
+      size_t n_leaves = 0;
+      for_each_leaf_range([&](size_t first, size_t last) {
+        n_leaves += last - first;
+      });
+      has_threshold_ = true;
+      if (n_leaves < min_tree_leaves || size_ > UINT32_MAX) {
+        threshold_index_ = min_leaf();
+        return;
+      }
+      leaf_tree_.resize(2 * n_leaves);
+      size_t p = n_leaves;
+      for_each_leaf_range([&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i)
+          leaf_tree_[p++] = static_cast<uint32_t>(i);
+      });
+      for (p = n_leaves - 1; p > 0; --p)
+        leaf_tree_[p] = lower_leaf(leaf_tree_[2 * p], leaf_tree_[2 * p + 1]);
+      threshold_index_ = leaf_tree_[1];
+      has_leaf_tree_ = true;
+    }
+
+    /// Updates the threshold after the element at threshold_index_ was
+    /// replaced and sifted up. Only the nodes above that leaf moved, so it is
+    /// the only leaf that changed: the tree follows the root down to it, and
+    /// replays its matches on the way back up.
+    void replaced_leaf() {
+      if (!has_leaf_tree_) {
+        has_threshold_ = false;
+        return;
+      }
+      size_t n_leaves = leaf_tree_.size() / 2;
+      size_t p = 1;
+      while (p < n_leaves)
+        p = leaf_tree_[2 * p] == leaf_tree_[p] ? 2 * p : 2 * p + 1;
+      for (p /= 2; p > 0; p /= 2)
+        leaf_tree_[p] = lower_leaf(leaf_tree_[2 * p], leaf_tree_[2 * p + 1]);
+      threshold_index_ = leaf_tree_[1];
+    }
+
+    uint32_t lower_leaf(uint32_t a, uint32_t b) const {
+      return cmp(at(b), at(a)) ? b : a;
+    }
+
+    void reserve_slots(size_t max_size) {
+      size_t blocks = (max_size + block_elems - 1) / block_elems;
+      c_.resize(std::max<size_t>(blocks, 1) * block_slots);
+    }
+
+    std::vector<T, Allocator> c_;
+    size_t size_;
+    size_t max_size_;
+    bool has_threshold_;
+    size_t threshold_index_;
+    bool has_leaf_tree_;
+    std::vector<uint32_t> leaf_tree_;
+    [[no_unique_address]] mutable Compare cmp;
+
+    // Smaller queues find their minimum by scanning the leaves.
+    static const size_t min_tree_leaves = 64;
+
+    static_assert(std::is_default_constructible<T>::value,
+                  "blocked_fixed_size_priority_queue preallocates its elements");
+
+  private:
+    // heap allocation is not allowed
+    void * operator new   (size_t);
+    void * operator new[] (size_t);
+    void   operator delete   (void *);
+    void   operator delete[] (void*);
+};
+
+#endif  // BLOCKED_FIXED_SIZE_PRIORITY_QUEUE_H_
@@ -0,0 +1,593 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CONCURRENT_FIXED_SIZE_PRIORITY_QUEUE_H_
+#define CONCURRENT_FIXED_SIZE_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "fixed-size-priority-queue.h"
+
+namespace fspq_detail {
+
+/// Bounded lock-free ring for many producers and one consumer. Every cell
+/// carries a sequence number which tells whose turn it is: a producer may
+/// fill the cell for position pos when the number is pos, the consumer may
+/// take it when it is pos + 1. Producers only contend on the tail counter.
+template<typename T>
+class mpsc_ring
+{
+  public:
+    explicit mpsc_ring(size_t capacity) : tail_(0), head_(0) {
+      size_t n = 1;
+      while (n < capacity)
+        n *= 2;
+      mask_ = n - 1;
+      cells_.reset(new cell[n]);
+      for (size_t i = 0; i < n; ++i)
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /// Returns false if the ring is full.
+    bool try_push(const T &x) {
+      size_t pos = tail_.load(std::memory_order_relaxed);
+      cell *c;
+      for (;;) {
+        c = &cells_[pos & mask_];
+        size_t sequence = c->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0) {
+          return false;
+        }
+        else {
+          pos = tail_.load(std::memory_order_relaxed);
+        }
+      }
+      c->value = x;
+      c->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    /// Consumer only. Returns false if the ring is empty.
+    bool try_pop(T &x) {
+      cell &c = cells_[head_ & mask_];
+      if (c.sequence.load(std::memory_order_acquire) != head_ + 1)
+        return false;
+      x = std::move(c.value);
+      c.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+      ++head_;
+      return true;
+    }
+
+  private:
+    struct cell
+    {
+      std::atomic<size_t> sequence;
+      T value;
+    };
+
+    std::unique_ptr<cell[]> cells_;
+    size_t mask_;
+    // Producers and the consumer write different lines.
+    alignas(cache_line_size) std::atomic<size_t> tail_;
+    alignas(cache_line_size) size_t head_;
+};
+
+/// Per-thread xorshift64* generator, cheap enough to pick a shard per call.
+inline uint64_t thread_random() {
+  static std::atomic<uint64_t> next_seed(0);
+  thread_local uint64_t state =
+      (next_seed.fetch_add(1, std::memory_order_relaxed) + 1) * 0x9e3779b97f4a7c15ull;
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dull;
+}
+
+/// A random number below n.
+inline size_t thread_random_below(size_t n) {
+  return static_cast<size_t>(((thread_random() >> 32) * n) >> 32);
+}
+
+}  // namespace fspq_detail
+
+/// A fixed size priority queue fed by many producer threads through a
+/// lock-free ring, and read by one consumer thread.
+///
+/// Producers call push, which never locks and never touches the heap. The
+/// consumer calls drain to move what was pushed into the queue, and then
+/// reads it with top, pop, size and empty. For arithmetic T, drain publishes
+/// the lowest element of a full queue as a threshold, and push drops any
+/// element that is not above it before it enters the ring. A threshold that
+/// lags behind a rising minimum only lets through elements that the queue
+/// then rejects itself. After a pop the queue has room again, so pop clears
+/// the threshold and bumps an epoch, which producers read before and after
+/// the threshold: a producer that saw the epoch change pushes its element
+/// after all, so no element is dropped on a threshold from before a pop.
+template<typename T, typename Compare = std::less<T> >
+class mpsc_fixed_size_priority_queue
+{
+  public:
+    explicit mpsc_fixed_size_priority_queue(size_t max_size, size_t ring_capacity = 4096,
+                                            const Compare &compare = Compare())
+        : q_(max_size, compare), ring_(ring_capacity), cmp(compare), max_size_(max_size),
+          has_threshold_(false), epoch_(0) {}
+
+    /// Producers. Returns false if the ring is full and x was not taken; an
+    /// element dropped by the threshold counts as taken.
+    inline bool push(const T &x) {
+      if (below_threshold(x, typename std::is_arithmetic<T>::type()))
+        return true;
+      return ring_.try_push(x);
+    }
+
+    /// Consumer. Moves up to max_batch elements from the ring into the
+    /// queue, and returns how many were moved.
+    size_t drain(size_t max_batch = static_cast<size_t>(-1)) {
+      size_t n = 0;
+      T x;
+      while (n < max_batch && ring_.try_pop(x)) {
+        q_.push(x);
+        ++n;
+      }
+      publish_threshold(typename std::is_arithmetic<T>::type());
+      return n;
+    }
+
+    /// Consumer.
+    inline void pop() {
+      q_.pop();
+      has_threshold_.store(false, std::memory_order_relaxed);
+      epoch_.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Consumer.
+    inline const T& top() const {
+      return q_.top();
+    }
+
+    /// Consumer.
+    inline const bool empty() const {
+      return q_.empty();
+    }
+
+    /// Consumer.
+    inline const size_t size() const {
+      return q_.size();
+    }
+
+  protected:
+    typedef typename std::conditional<std::is_arithmetic<T>::value, T, char>::type threshold_type;
+
+    // Like a seqlock reader: the drop only stands if no pop bumped the epoch
+    // while the threshold was read. A producer that sees the bump also sees
+    // the threshold cleared before it.
+    inline bool below_threshold(const T &x, std::true_type) {
+      uint64_t epoch = epoch_.load(std::memory_order_acquire);
+      if (!has_threshold_.load(std::memory_order_acquire) ||
+          cmp(threshold_.load(std::memory_order_relaxed), x))
+        return false;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return epoch_.load(std::memory_order_relaxed) == epoch;
+    }
+    inline bool below_threshold(const T &, std::false_type) {
+      return false;
+    }
+
+    inline void publish_threshold(std::true_type) {
+      if (max_size_ == 0 || q_.size() < max_size_)
+        return;
+      threshold_.store(q_.bottom(), std::memory_order_relaxed);
+      has_threshold_.store(true, std::memory_order_release);
+    }
+    inline void publish_threshold(std::false_type) {}
+
+    fixed_size_priority_queue<T, Compare> q_;
+    fspq_detail::mpsc_ring<T> ring_;
+    Compare cmp;
+    size_t max_size_;
+    std::atomic<threshold_type> threshold_;
+    std::atomic<bool> has_threshold_;
+    std::atomic<uint64_t> epoch_;
+};
+
+/// A fixed size priority queue with one writer thread, which publishes its
+/// N best elements to any number of reader threads through a seqlock.
+///
+/// The writer uses push and pop like on fixed_size_priority_queue, and keeps
+/// its own sorted copy of the N best elements: push inserts into it in O(N),
+/// only pop rereads it from the queue. Whenever they change the N best
+/// elements, the writer copies them into a block of atomic words under a
+/// sequence counter, which is odd while a copy is in progress. Readers copy
+/// the block out and retry if the counter was odd or changed meanwhile, so
+/// they never lock and never hold up the writer.
+template<typename T, size_t N = 1, typename Compare = std::less<T> >
+class seqlock_fixed_size_priority_queue
+{
+  public:
+    explicit seqlock_fixed_size_priority_queue(size_t max_size,
+                                               const Compare &compare = Compare())
+        : q_(max_size, compare), max_size_(max_size), cmp(compare), count_(0), sequence_(0) {
+      for (size_t i = 0; i < n_words; ++i)
+        words_[i].store(0, std::memory_order_relaxed);
+    }
+
+    /// Writer.
+    inline void push(const T &x) {
+      // While the queue holds fewer than N elements, best_ holds all of them
+      // and the queue takes x if it has room. Otherwise x changes the N best
+      // only if it beats the last of them, which the queue takes too.
+      bool room = count_ < N && q_.size() < max_size_;
+      if (!room && !(count_ > 0 && cmp(best_[count_ - 1], x))) {
+        q_.push(x);
+        return;
+      }
+      q_.push(x);
+      size_t i = room ? count_++ : count_ - 1;
+      for (; i > 0 && cmp(best_[i - 1], x); --i)
+        best_[i] = best_[i - 1];
+      best_[i] = x;
+      publish();
+    }
+
+    /// Writer.
+    inline void pop() {
+      q_.pop();
+      reread_best(std::integral_constant<bool, N == 1>());
+      publish();
+    }
+
+    /// Writer.
+    inline const bool empty() const {
+      return q_.empty();
+    }
+
+    /// Writer.
+    inline const size_t size() const {
+      return q_.size();
+    }
+
+    /// Readers. Copies the published best element to x, or returns false if
+    /// the queue was empty.
+    bool top(T &x) const {
+      T best[N];
+      if (top_n(best) == 0)
+        return false;
+      x = best[0];
+      return true;
+    }
+
+    /// Readers. Copies the published best elements to out, best first, and
+    /// returns how many there were, at most N.
+    size_t top_n(T *out) const {
+      uint64_t words[n_words];
+      for (;;) {
+        uint64_t before = sequence_.load(std::memory_order_acquire);
+        if (before & 1)
+          continue;
+        for (size_t i = 0; i < n_words; ++i)
+          words[i] = words_[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_.load(std::memory_order_relaxed) == before)
+          break;
+      }
+      uint64_t count = words[0];
+      memcpy(static_cast<void *>(out), words + 1, count * sizeof(T));
+      return count;
+    }
+
+  protected:
+    // The element count, then the elements.
+    static const size_t n_words = 1 + (N * sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    /// Takes the N best elements from the queue after a pop.
+    inline void reread_best(std::true_type) {
+      count_ = q_.empty() ? 0 : 1;
+      if (count_ > 0)
+        best_[0] = q_.top();
+    }
+    inline void reread_best(std::false_type) {
+      fspq_detail::reverse_compare<Compare> higher(cmp);
+      count_ = std::partial_sort_copy(q_.begin(), q_.end(), best_, best_ + N, higher) - best_;
+    }
+
+    /// Copies best_ to the readers.
+    void publish() {
+      uint64_t words[n_words] = {};
+      words[0] = count_;
+      memcpy(words + 1, static_cast<const void *>(best_), count_ * sizeof(T));
+      uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+      sequence_.store(sequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      for (size_t i = 0; i < n_words; ++i)
+        words_[i].store(words[i], std::memory_order_relaxed);
+      sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    fixed_size_priority_queue<T, Compare> q_;
+    size_t max_size_;
+    Compare cmp;
+    // The writer's copy of what it published, best first.
+    T best_[N];
+    size_t count_;
+    alignas(fspq_detail::cache_line_size) std::atomic<uint64_t> sequence_;
+    std::atomic<uint64_t> words_[n_words];
+
+    static_assert(N > 0, "nothing to publish");
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "readers copy the published elements word by word");
+};
+
+/// A fixed size priority queue with one writer thread, whose contents are
+/// published as immutable snapshots that reader threads can iterate while
+/// the writer goes on.
+///
+/// The writer uses push and pop as usual, and calls publish to make the
+/// current contents visible. publish copies them into a spare buffer and
+/// swaps it in with one atomic exchange; the buffer it replaces is retired,
+/// and reused by a later publish once no reader can still see it. Readers
+/// take a snapshot, which pins the current epoch in one of max_readers slots
+/// for as long as it lives; a retired buffer is free again when every pinned
+/// epoch is newer than the one it was retired in. The buffers are recycled,
+/// so a writer that publishes regularly stops allocating.
+template<typename T, typename Compare = std::less<T> >
+class snapshot_fixed_size_priority_queue
+{
+    typedef std::vector<T> buffer;
+
+  public:
+    /// Read only view of the contents at one publish, in no particular order.
+    class snapshot
+    {
+      public:
+        typedef typename buffer::const_iterator iterator;
+
+        snapshot(snapshot &&other) : buffer_(other.buffer_), slot_(other.slot_) {
+          other.slot_ = 0;
+        }
+        ~snapshot() {
+          if (slot_)
+            slot_->store(0);
+        }
+
+        iterator begin() const { return buffer_->begin(); }
+        iterator end() const { return buffer_->end(); }
+        size_t size() const { return buffer_->size(); }
+        bool empty() const { return buffer_->empty(); }
+
+      private:
+        friend class snapshot_fixed_size_priority_queue;
+        snapshot(const buffer *b, std::atomic<uint64_t> *slot) : buffer_(b), slot_(slot) {}
+        snapshot(const snapshot &);
+        snapshot &operator=(const snapshot &);
+
+        const buffer *buffer_;
+        std::atomic<uint64_t> *slot_;
+    };
+
+    explicit snapshot_fixed_size_priority_queue(size_t max_size, size_t max_readers = 64,
+                                                const Compare &compare = Compare())
+        : q_(max_size, compare), epoch_(1), slots_(new pinned_epoch[max_readers]),
+          max_readers_(max_readers) {
+      buffers_.push_back(std::unique_ptr<buffer>(new buffer()));
+      current_.store(buffers_.back().get());
+    }
+
+    /// Writer.
+    inline void push(const T &x) {
+      q_.push(x);
+    }
+
+    /// Writer.
+    inline void pop() {
+      q_.pop();
+    }
+
+    /// Writer.
+    inline const T& top() const {
+      return q_.top();
+    }
+
+    /// Writer.
+    inline const bool empty() const {
+      return q_.empty();
+    }
+
+    /// Writer.
+    inline const size_t size() const {
+      return q_.size();
+    }
+
+    /// Writer. Makes the current contents what new snapshots see.
+    void publish() {
+      reclaim();
+      buffer *b;
+      if (free_.empty()) {
+        buffers_.push_back(std::unique_ptr<buffer>(new buffer()));
+        b = buffers_.back().get();
+      }
+      else {
+        b = free_.back();
+        free_.pop_back();
+      }
+      b->assign(q_.begin(), q_.end());
+      buffer *old = current_.exchange(b);
+      retired_.push_back(std::make_pair(old, epoch_.fetch_add(1)));
+    }
+
+    /// Readers. Waits for a free slot if max_readers snapshots are alive.
+    snapshot read() const {
+      for (;;) {
+        for (size_t i = 0; i < max_readers_; ++i) {
+          uint64_t unpinned = 0;
+          if (slots_[i].epoch.compare_exchange_strong(unpinned, epoch_.load()))
+            return snapshot(current_.load(), &slots_[i].epoch);
+        }
+        std::this_thread::yield();
+      }
+    }
+
+  protected:
+    struct pinned_epoch
+    {
+      pinned_epoch() : epoch(0) {}
+      alignas(fspq_detail::cache_line_size) std::atomic<uint64_t> epoch;
+    };
+
+    /// Moves the retired buffers no reader can see any more to the free list.
+    void reclaim() {
+      uint64_t oldest = static_cast<uint64_t>(-1);
+      for (size_t i = 0; i < max_readers_; ++i) {
+        uint64_t pinned = slots_[i].epoch.load();
+        if (pinned != 0)
+          oldest = std::min(oldest, pinned);
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < retired_.size(); ++i) {
+        if (retired_[i].second < oldest)
+          free_.push_back(retired_[i].first);
+        else
+          retired_[kept++] = retired_[i];
+      }
+      retired_.resize(kept);
+    }
+
+    fixed_size_priority_queue<T, Compare> q_;
+    std::atomic<buffer *> current_;
+    std::atomic<uint64_t> epoch_;
+    std::unique_ptr<pinned_epoch[]> slots_;
+    size_t max_readers_;
+    // Writer only: all buffers, those free for reuse, and the retired ones
+    // with the epoch they were retired in.
+    std::vector<std::unique_ptr<buffer> > buffers_;
+    std::vector<buffer *> free_;
+    std::vector<std::pair<buffer *, uint64_t> > retired_;
+};
+
+/// A relaxed concurrent fixed size priority queue (a MultiQueue), for
+/// scheduling work across threads where the order need not be exact.
+///
+/// The elements are spread over shards_per_thread * num_threads shards,
+/// each a fixed_size_priority_queue with its own lock and an equal share of
+/// max_size; a full shard evicts its own lowest element. push goes to a
+/// random shard, and try_pop takes the higher of the tops of two random
+/// shards. Locks are only ever tried, and a busy shard is skipped for
+/// another random one, so threads rarely wait on each other. In exchange
+/// try_pop returns an element near the top rather than the top: the
+/// expected rank is O(number of shards).
+template<typename T, typename Compare = std::less<T> >
+class multi_fixed_size_priority_queue
+{
+  public:
+    explicit multi_fixed_size_priority_queue(size_t max_size, size_t num_threads = 0,
+                                             size_t shards_per_thread = 2,
+                                             const Compare &compare = Compare())
+        : cmp(compare) {
+      if (num_threads == 0)
+        num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+      num_shards_ = std::max<size_t>(shards_per_thread * num_threads, 2);
+      size_t shard_size = (max_size + num_shards_ - 1) / num_shards_;
+      for (size_t i = 0; i < num_shards_; ++i)
+        shards_.push_back(std::unique_ptr<shard>(new shard(shard_size, compare)));
+    }
+
+    inline void push(const T &x) {
+      for (;;) {
+        shard &s = *shards_[fspq_detail::thread_random_below(num_shards_)];
+        if (!s.lock.try_lock())
+          continue;
+        s.q.push(x);
+        s.size.store(s.q.size(), std::memory_order_relaxed);
+        s.lock.unlock();
+        return;
+      }
+    }
+
+    /// Removes an element near the top and copies it to x. Returns false if
+    /// the queue was empty.
+    bool try_pop(T &x) {
+      for (;;) {
+        shard &a = *shards_[fspq_detail::thread_random_below(num_shards_)];
+        shard &b = *shards_[fspq_detail::thread_random_below(num_shards_)];
+        if (&a == &b || !a.lock.try_lock())
+          continue;
+        if (!b.lock.try_lock()) {
+          a.lock.unlock();
+          continue;
+        }
+        shard *best = &a;
+        if (a.q.empty() || (!b.q.empty() && cmp(a.q.top(), b.q.top())))
+          best = &b;
+        bool found = !best->q.empty();
+        if (found) {
+          x = best->q.top();
+          best->q.pop();
+          best->size.store(best->q.size(), std::memory_order_relaxed);
+        }
+        a.lock.unlock();
+        b.lock.unlock();
+        if (found)
+          return true;
+        if (empty())
+          return false;
+      }
+    }
+
+    /// Number of elements; only exact while no thread pushes or pops.
+    inline const size_t size() const {
+      size_t n = 0;
+      for (size_t i = 0; i < num_shards_; ++i)
+        n += shards_[i]->size.load(std::memory_order_relaxed);
+      return n;
+    }
+
+    inline const bool empty() const {
+      return size() == 0;
+    }
+
+    inline const size_t num_shards() const {
+      return num_shards_;
+    }
+
+  protected:
+    struct shard
+    {
+      shard(size_t max_size, const Compare &compare) : q(max_size, compare), size(0) {}
+      alignas(fspq_detail::cache_line_size) std::mutex lock;
+      fixed_size_priority_queue<T, Compare> q;
+      // Read without the lock by empty() and size().
+      std::atomic<size_t> size;
+    };
+
+    std::vector<std::unique_ptr<shard> > shards_;
+    size_t num_shards_;
+    Compare cmp;
+};
+
+#endif  // CONCURRENT_FIXED_SIZE_PRIORITY_QUEUE_H_
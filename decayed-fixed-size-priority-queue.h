@@ -0,0 +1,117 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECAYED_FIXED_SIZE_PRIORITY_QUEUE_H_
+#define DECAYED_FIXED_SIZE_PRIORITY_QUEUE_H_
+
+#include <cmath>
+
+#include "fixed-size-priority-queue.h"
+
+namespace fspq_detail {
+
+/// An element with its forward decay key log(score) + rate * (time - landmark).
+template<typename T>
+struct decayed_entry
+{
+  double key;
+  T value;
+};
+
+struct decayed_key_less
+{
+  template<typename T>
+  bool operator()(const decayed_entry<T> &a, const decayed_entry<T> &b) const {
+    return a.key < b.key;
+  }
+};
+
+}  // namespace fspq_detail
+
+/// A fixed size priority queue of elements whose scores decay exponentially
+/// with time, score * 2^(-(now - time) / half_life), for "trending" top-k.
+///
+/// Decaying every stored score on each tick would cost O(k) and break the
+/// heap order. Instead, with forward decay, an element pushed at time t is
+/// keyed by log(score) + rate * (t - landmark): the decayed scores at any
+/// later time are these keys shifted by the same amount, so the order of
+/// the heap never changes and push stays O(log k). As time moves away from
+/// the landmark the keys grow; once they could lose precision, the landmark
+/// moves up to the current time and the keys are shifted down by the same
+/// amount, which again leaves the heap order intact.
+template<typename T, size_t Arity = 2>
+class decayed_fixed_size_priority_queue
+{
+    typedef fspq_detail::decayed_entry<T> entry;
+    typedef fixed_size_priority_queue<entry, fspq_detail::decayed_key_less, Arity> queue_type;
+
+  public:
+    decayed_fixed_size_priority_queue(size_t max_size, double half_life, double landmark = 0)
+        : q_(max_size), rate_(std::log(2.0) / half_life), landmark_(landmark) {}
+
+    /// Pushes x with a positive score at the given time. Times need not be
+    /// in order.
+    inline void push(const T &x, double score, double time) {
+      if (rate_ * (time - landmark_) > max_offset)
+        renormalize(time);
+      entry e = { std::log(score) + rate_ * (time - landmark_), x };
+      q_.push(e);
+    }
+
+    inline void pop() {
+      q_.pop();
+    }
+
+    /// The element with the highest decayed score, at any time.
+    inline const T& top() const {
+      return q_.top().value;
+    }
+
+    /// The decayed score of top() at time now.
+    inline double top_score(double now) const {
+      return std::exp(q_.top().key - rate_ * (now - landmark_));
+    }
+
+    inline const bool empty() const {
+      return q_.empty();
+    }
+
+    inline const size_t size() const {
+      return q_.size();
+    }
+
+    inline double landmark() const {
+      return landmark_;
+    }
+
+  protected:
+    /// Keys may grow this far above log(score) before the landmark moves, so
+    /// that a double still resolves them to about 1e-13.
+    static constexpr double max_offset = 512;
+
+    /// Moves the landmark to time, shifting all keys by the same amount.
+    void renormalize(double time) {
+      double shift = rate_ * (time - landmark_);
+      for (typename queue_type::iterator it = q_.begin(); it != q_.end(); ++it)
+        it->key -= shift;
+      landmark_ = time;
+    }
+
+    queue_type q_;
+    double rate_;
+    double landmark_;
+};
+
+#endif  // DECAYED_FIXED_SIZE_PRIORITY_QUEUE_H_
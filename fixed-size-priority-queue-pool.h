@@ -0,0 +1,181 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FIXED_SIZE_PRIORITY_QUEUE_POOL_H_
+#define FIXED_SIZE_PRIORITY_QUEUE_POOL_H_
+
+#include <algorithm>
+#include <functional>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+#include "fixed-size-priority-queue.h"
+
+/// num_queues fixed size priority queues with the same maximum size, such as
+/// the beams of a batch of utterances. The elements of all queues live in one
+/// array, queue q in the max_size slots from q * max_size on, each a max-heap
+/// like fixed_size_priority_queue. The per-queue state (sizes and cached
+/// eviction thresholds) is kept in arrays across queues. Queues with at least
+/// 64 leaves also keep a tournament tree over them, like
+/// fixed_size_priority_queue, so replacing the minimum of a full queue stays
+/// O(log k).
+template<typename T, typename Compare = std::less<T> >
+class fixed_size_priority_queue_pool
+{
+  public:
+    fixed_size_priority_queue_pool(size_t num_queues, size_t max_size,
+                                   const Compare &compare = Compare())
+        : c_(num_queues * max_size), sizes_(num_queues, 0),
+          thresholds_(num_queues, no_threshold), max_size_(max_size),
+          n_leaves_(max_size - fspq_detail::first_leaf<2>(max_size)), cmp(compare) {
+      if (n_leaves_ >= min_tree_leaves)
+        leaf_trees_.resize(num_queues * 2 * n_leaves_);
+    }
+
+    /// Offers x to queue q.
+    inline void push(size_t q, const T &x) {
+      T *first = c_.data() + q * max_size_;
+      uint32_t &n = sizes_[q];
+      if (n == max_size_) {
+        if (n == 0)
+          return;
+        // The minimum is kept as the threshold until it gets replaced.
+        uint32_t &threshold = thresholds_[q];
+        if (threshold == no_threshold)
+          threshold = find_threshold(q, first);
+        if (cmp(first[threshold], x)) {
+          first[threshold] = x;
+          fspq_detail::sift_up<2>(first, threshold, cmp);
+          threshold = replaced_leaf(q, first, threshold);
+        }
+      }
+      else {
+        first[n] = x;
+        fspq_detail::sift_up<2>(first, n++, cmp);
+      }
+    }
+
+    /// Pushes a batch: element i of [first, last) goes to queue queues[i].
+    template<typename InputIterator, typename QueueIterator>
+    void push(InputIterator first, InputIterator last, QueueIterator queues) {
+      for (; first != last; ++first, ++queues)
+        push(*queues, *first);
+    }
+
+    inline void pop(size_t q) {
+      uint32_t &n = sizes_[q];
+      if (n == 0)
+        return;
+      fspq_detail::pop_heap<2>(c_.data() + q * max_size_, n--, cmp);
+      thresholds_[q] = no_threshold;
+    }
+
+    inline const T& top(size_t q) const {
+      return c_.data()[q * max_size_];
+    }
+
+    inline const bool empty(size_t q) const {
+      return sizes_[q] == 0;
+    }
+
+    inline const size_t size(size_t q) const {
+      return sizes_[q];
+    }
+
+    inline const size_t num_queues() const {
+      return sizes_.size();
+    }
+
+    inline const size_t max_size() const {
+      return max_size_;
+    }
+
+    /// Empties queue q, writing its elements to out best first.
+    template<typename OutputIterator>
+    OutputIterator drain(size_t q, OutputIterator out) {
+      T *first = c_.data() + q * max_size_;
+      for (size_t n = sizes_[q]; n > 1; --n)
+        fspq_detail::pop_heap<2>(first, n, cmp);
+      out = std::reverse_copy(first, first + sizes_[q], out);
+      sizes_[q] = 0;
+      thresholds_[q] = no_threshold;
+      return out;
+    }
+
+    /// Empties all queues, keeping the memory.
+    inline void clear() {
+      std::fill(sizes_.begin(), sizes_.end(), 0);
+      std::fill(thresholds_.begin(), thresholds_.end(), no_threshold);
+    }
+
+  protected:
+    static constexpr uint32_t no_threshold = static_cast<uint32_t>(-1);
+
+    /// The minimum of a max-heap is one of its leaves.
+    inline uint32_t min_leaf(const T *first, size_t n) const {
+      return static_cast<uint32_t>(
+          std::min_element(first + fspq_detail::first_leaf<2>(n), first + n, cmp) - first);
+    }
+
+    /// Returns the minimum of the full queue q. For large queues this builds
+    /// its tournament tree: tree[p] holds the lower leaf of its children 2p
+    /// and 2p + 1, as an offset from the first leaf, the leaves themselves
+    /// are at n_leaves_ + offset, and the root is tree[1].
+    inline uint32_t find_threshold(size_t q, const T *first) {
+      if (leaf_trees_.empty())
+        return min_leaf(first, max_size_);
+      const T *leaves = first + (max_size_ - n_leaves_);
+      uint32_t *tree = leaf_trees_.data() + q * 2 * n_leaves_;
+      for (size_t i = 0; i < n_leaves_; ++i)
+        tree[n_leaves_ + i] = static_cast<uint32_t>(i);
+      for (size_t p = n_leaves_ - 1; p > 0; --p)
+        tree[p] = lower_leaf(leaves, tree[2 * p], tree[2 * p + 1]);
+      return static_cast<uint32_t>(max_size_ - n_leaves_ + tree[1]);
+    }
+
+    /// Returns the new minimum of the full queue q after its leaf was
+    /// replaced and sifted up, which left the other leaves alone.
+    inline uint32_t replaced_leaf(size_t q, const T *first, uint32_t leaf) {
+      if (leaf_trees_.empty())
+        return no_threshold;
+      size_t first_leaf = max_size_ - n_leaves_;
+      const T *leaves = first + first_leaf;
+      uint32_t *tree = leaf_trees_.data() + q * 2 * n_leaves_;
+      for (size_t p = (n_leaves_ + leaf - first_leaf) / 2; p > 0; p /= 2)
+        tree[p] = lower_leaf(leaves, tree[2 * p], tree[2 * p + 1]);
+      return static_cast<uint32_t>(first_leaf + tree[1]);
+    }
+
+    inline uint32_t lower_leaf(const T *leaves, uint32_t a, uint32_t b) const {
+      return cmp(leaves[b], leaves[a]) ? b : a;
+    }
+
+    // Smaller queues find their minimum by scanning the leaves.
+    static constexpr size_t min_tree_leaves = 64;
+
+    std::vector<T> c_;
+    std::vector<uint32_t> sizes_;
+    std::vector<uint32_t> thresholds_;
+    size_t max_size_;
+    size_t n_leaves_;
+    std::vector<uint32_t> leaf_trees_;
+    [[no_unique_address]] mutable Compare cmp;
+
+    static_assert(std::is_default_constructible<T>::value,
+                  "fixed_size_priority_queue_pool preallocates the slots of all queues");
+};
+
+#endif  // FIXED_SIZE_PRIORITY_QUEUE_POOL_H_
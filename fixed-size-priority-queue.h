@@ -18,63 +18,815 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string.h>
+#include <type_traits>
+#include <stdint.h>
+#include <utility>
 #include <vector>
 
+namespace fspq_detail {
+
+const size_t cache_line_size = 64;
+
+/// Allocator which places element 1 of every allocation at the start of a
+/// cache line. In a heap rooted at index 0 the children of node i are
+/// Arity * i + 1 ... Arity * i + Arity, so when Arity * sizeof(T) is the cache
+/// line size, each group of siblings fills exactly one line.
+template<typename T>
+class child_aligned_allocator
+{
+  public:
+    typedef T value_type;
+    template<typename U> struct rebind { typedef child_aligned_allocator<U> other; };
+
+    child_aligned_allocator() {}
+    template<typename U> child_aligned_allocator(const child_aligned_allocator<U> &) {}
+
+    T *allocate(size_t n) {
+      char *raw = static_cast<char *>(
+          ::operator new(n * sizeof(T) + sizeof(void *) + cache_line_size));
+      uintptr_t second = reinterpret_cast<uintptr_t>(raw) + sizeof(void *) + sizeof(T);
+      second = (second + cache_line_size - 1) & ~(uintptr_t)(cache_line_size - 1);
+      char *first = reinterpret_cast<char *>(second - sizeof(T));
+      memcpy(first - sizeof(void *), &raw, sizeof(void *));
+      return reinterpret_cast<T *>(first);
+    }
+
+    void deallocate(T *p, size_t) {
+      void *raw;
+      memcpy(&raw, reinterpret_cast<char *>(p) - sizeof(void *), sizeof(void *));
+      ::operator delete(raw);
+    }
+
+    template<typename U>
+    bool operator==(const child_aligned_allocator<U> &) const { return true; }
+    template<typename U>
+    bool operator!=(const child_aligned_allocator<U> &) const { return false; }
+};
+
+/// Orders elements from the highest priority to the lowest.
+template<typename Compare>
+class reverse_compare
+{
+  public:
+    reverse_compare(Compare &cmp) : cmp_(&cmp) {}
+    template<typename U>
+    bool operator()(const U &a, const U &b) const { return (*cmp_)(b, a); }
+
+  private:
+    Compare *cmp_;
+};
+
+/// Output iterator which drops everything written to it.
+class discard_iterator
+{
+  public:
+    typedef std::output_iterator_tag iterator_category;
+    typedef void value_type;
+    typedef void difference_type;
+    typedef void pointer;
+    typedef void reference;
+
+    discard_iterator &operator*() { return *this; }
+    discard_iterator &operator++() { return *this; }
+    discard_iterator operator++(int) { return *this; }
+    template<typename U>
+    discard_iterator &operator=(const U &) { return *this; }
+};
+
+/// A vector whose first N elements live inside the object. Storage comes
+/// from Allocator only once more than N elements are held, and goes back
+/// inline when shrink_to_fit finds that they fit again.
+template<typename T, size_t N, typename Allocator = std::allocator<T> >
+class small_vector
+{
+  public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef size_t size_type;
+
+    small_vector() : begin_(inline_data()), size_(0), capacity_(N) {}
+    small_vector(const small_vector &other) : begin_(inline_data()), size_(0), capacity_(N) {
+      reserve(other.size_);
+      std::uninitialized_copy(other.begin(), other.end(), begin_);
+      size_ = other.size_;
+    }
+    small_vector(small_vector &&other) : begin_(inline_data()), size_(0), capacity_(N) {
+      steal(other);
+    }
+    ~small_vector() {
+      clear();
+      release();
+    }
+
+    small_vector &operator=(const small_vector &other) {
+      if (this != &other) {
+        clear();
+        reserve(other.size_);
+        std::uninitialized_copy(other.begin(), other.end(), begin_);
+        size_ = other.size_;
+      }
+      return *this;
+    }
+    small_vector &operator=(small_vector &&other) {
+      if (this != &other) {
+        clear();
+        release();
+        steal(other);
+      }
+      return *this;
+    }
+
+    iterator begin() { return begin_; }
+    iterator end() { return begin_ + size_; }
+    const_iterator begin() const { return begin_; }
+    const_iterator end() const { return begin_ + size_; }
+    T *data() { return begin_; }
+    const T *data() const { return begin_; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t capacity() const { return capacity_; }
+    /// Whether the elements are in the inline buffer.
+    bool is_inline() const { return begin_ == inline_data(); }
+
+    T &front() { return begin_[0]; }
+    const T &front() const { return begin_[0]; }
+    T &operator[](size_t i) { return begin_[i]; }
+    const T &operator[](size_t i) const { return begin_[i]; }
+
+    void push_back(const T &x) {
+      if (size_ == capacity_) {
+        // x may be one of the elements that are about to move.
+        T copy(x);
+        grow(2 * capacity_);
+        ::new (static_cast<void *>(begin_ + size_)) T(std::move(copy));
+      }
+      else {
+        ::new (static_cast<void *>(begin_ + size_)) T(x);
+      }
+      ++size_;
+    }
+    void push_back(T &&x) {
+      if (size_ == capacity_)
+        grow(2 * capacity_);
+      ::new (static_cast<void *>(begin_ + size_)) T(std::move(x));
+      ++size_;
+    }
+
+    void pop_back() {
+      begin_[--size_].~T();
+    }
+
+    iterator erase(iterator first, iterator last) {
+      iterator new_end = std::move(last, end(), first);
+      std::destroy(new_end, end());
+      size_ -= last - first;
+      return first;
+    }
+
+    void clear() {
+      std::destroy(begin_, begin_ + size_);
+      size_ = 0;
+    }
+
+    void reserve(size_t n) {
+      if (n > capacity_)
+        grow(n);
+    }
+
+    void shrink_to_fit() {
+      if (is_inline() || size_ == capacity_)
+        return;
+      grow(std::max(size_, N));
+    }
+
+    void swap(small_vector &other) {
+      small_vector tmp(std::move(other));
+      other = std::move(*this);
+      *this = std::move(tmp);
+    }
+
+  private:
+    T *inline_data() { return reinterpret_cast<T *>(inline_); }
+    const T *inline_data() const { return reinterpret_cast<const T *>(inline_); }
+
+    // Moves the elements to storage for n of them, inline if n is N.
+    void grow(size_t n) {
+      T *p = n == N ? inline_data() : alloc_.allocate(n);
+      std::uninitialized_move(begin_, begin_ + size_, p);
+      std::destroy(begin_, begin_ + size_);
+      release();
+      begin_ = p;
+      capacity_ = n;
+    }
+
+    void release() {
+      if (!is_inline())
+        alloc_.deallocate(begin_, capacity_);
+      begin_ = inline_data();
+      capacity_ = N;
+    }
+
+    // Takes over the elements of other, leaving it empty. This one must be
+    // empty and inline.
+    void steal(small_vector &other) {
+      if (other.is_inline()) {
+        std::uninitialized_move(other.begin(), other.end(), begin_);
+        size_ = other.size_;
+        other.clear();
+      }
+      else {
+        begin_ = other.begin_;
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        other.begin_ = other.inline_data();
+        other.size_ = 0;
+        other.capacity_ = N;
+      }
+    }
+
+    alignas(T) unsigned char inline_[N * sizeof(T)];
+    T *begin_;
+    size_t size_;
+    size_t capacity_;
+    [[no_unique_address]] Allocator alloc_;
+
+    static_assert(N > 0, "use std::vector for no inline elements");
+};
+
+/// An element stored together with its precomputed key.
+template<typename Key, typename T>
+struct keyed_element
+{
+  Key key;
+  T value;
+};
+
+/// Compares keyed elements by their keys.
+template<typename Compare>
+class key_compare
+{
+  public:
+    key_compare(Compare &cmp) : cmp_(&cmp) {}
+    template<typename U>
+    bool operator()(const U &a, const U &b) const { return (*cmp_)(a.key, b.key); }
+
+  private:
+    Compare *cmp_;
+};
+
+/// Iterator over the values of keyed elements.
+template<typename BaseIterator, typename T>
+class value_iterator
+{
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef ptrdiff_t difference_type;
+    typedef T* pointer;
+    typedef T& reference;
+
+    value_iterator() {}
+    explicit value_iterator(BaseIterator it) : it_(it) {}
+    reference operator*() const { return it_->value; }
+    pointer operator->() const { return &it_->value; }
+    reference operator[](difference_type n) const { return it_[n].value; }
+    value_iterator &operator++() { ++it_; return *this; }
+    value_iterator operator++(int) { value_iterator it = *this; ++it_; return it; }
+    value_iterator &operator--() { --it_; return *this; }
+    value_iterator operator--(int) { value_iterator it = *this; --it_; return it; }
+    value_iterator &operator+=(difference_type n) { it_ += n; return *this; }
+    value_iterator &operator-=(difference_type n) { it_ -= n; return *this; }
+    value_iterator operator+(difference_type n) const { return value_iterator(it_ + n); }
+    value_iterator operator-(difference_type n) const { return value_iterator(it_ - n); }
+    difference_type operator-(const value_iterator &other) const { return it_ - other.it_; }
+    bool operator==(const value_iterator &other) const { return it_ == other.it_; }
+    bool operator!=(const value_iterator &other) const { return it_ != other.it_; }
+    bool operator<(const value_iterator &other) const { return it_ < other.it_; }
+
+  private:
+    BaseIterator it_;
+};
+
+/// How fixed_size_priority_queue stores elements for a projection: with
+/// std::identity an element is its own key, otherwise the key is computed
+/// once and kept next to the element.
+template<typename T, typename Projection>
+struct element_traits
+{
+  typedef typename std::decay<decltype(
+      std::declval<Projection &>()(std::declval<const T &>()))>::type key_type;
+  typedef keyed_element<key_type, T> stored_type;
+  // What make_key returns: the computed key, or x itself for std::identity.
+  typedef key_type key_result;
+
+  template<typename Compare> struct compare { typedef key_compare<Compare> type; };
+  template<typename BaseIterator> struct iterator { typedef value_iterator<BaseIterator, T> type; };
+
+  static key_type make_key(const T &x, Projection &projection) { return projection(x); }
+  static stored_type make(const T &x, const key_type &key) {
+    stored_type s = { key, x };
+    return s;
+  }
+  static const key_type &key(const stored_type &s) { return s.key; }
+  static const T &value(const stored_type &s) { return s.value; }
+};
+
+template<typename T>
+struct element_traits<T, std::identity>
+{
+  typedef T key_type;
+  typedef T stored_type;
+  typedef const T &key_result;
+
+  template<typename Compare> struct compare { typedef Compare &type; };
+  template<typename BaseIterator> struct iterator { typedef BaseIterator type; };
+
+  static const T &make_key(const T &x, std::identity &) { return x; }
+  static const T &make(const T &x, const T &) { return x; }
+  static const T &key(const T &s) { return s; }
+  static const T &value(const T &s) { return s; }
+};
+
+/// Index of the first leaf of a heap of n elements.
+template<size_t Arity>
+inline size_t first_leaf(size_t n) {
+  return n <= 1 ? 0 : (n - 2) / Arity + 1;
+}
+
+/// Moves first[i] up until its parent is not lower than it.
+template<size_t Arity, typename RandomIt, typename Compare>
+void sift_up(RandomIt first, size_t i, Compare &cmp) {
+  typename std::iterator_traits<RandomIt>::value_type x = std::move(first[i]);
+  while (i > 0) {
+    size_t parent = (i - 1) / Arity;
+    if (!cmp(first[parent], x))
+      break;
+    first[i] = std::move(first[parent]);
+    i = parent;
+  }
+  first[i] = std::move(x);
+}
+
+/// Moves first[i] down until none of its children is higher than it.
+template<size_t Arity, typename RandomIt, typename Compare>
+void sift_down(RandomIt first, size_t n, size_t i, Compare &cmp) {
+  typename std::iterator_traits<RandomIt>::value_type x = std::move(first[i]);
+  for (size_t child = Arity * i + 1; child < n; child = Arity * i + 1) {
+    size_t last = std::min(child + Arity, n);
+    size_t best = child;
+    for (size_t c = child + 1; c < last; ++c) {
+      if (cmp(first[best], first[c]))
+        best = c;
+    }
+    if (!cmp(x, first[best]))
+      break;
+    first[i] = std::move(first[best]);
+    i = best;
+  }
+  first[i] = std::move(x);
+}
+
+template<size_t Arity, typename RandomIt, typename Compare>
+void make_heap(RandomIt first, size_t n, Compare &cmp) {
+  for (size_t i = first_leaf<Arity>(n); i > 0; --i)
+    sift_down<Arity>(first, n, i - 1, cmp);
+}
+
+/// Moves the top of the heap to first[n - 1] and restores the heap order of
+/// the remaining n - 1 elements.
+template<size_t Arity, typename RandomIt, typename Compare>
+void pop_heap(RandomIt first, size_t n, Compare &cmp) {
+  if (n <= 1)
+    return;
+  std::swap(first[0], first[n - 1]);
+  sift_down<Arity>(first, n - 1, 0, cmp);
+}
+
+}  // namespace fspq_detail
+
 /// A priority queue with fixed size. When the maximum size was reached,
 /// the element with the lowest priority would be removed automatically.
-template<typename T, typename Compare = std::less<T> >
+///
+/// The elements are kept in an Arity-ary max-heap. Wider heaps are shallower,
+/// which pays off for large queues where every level of a binary heap costs a
+/// cache miss; sibling groups are aligned to cache lines.
+///
+/// A full queue keeps its minimum as a threshold, so rejecting an element
+/// takes one comparison. A replacement sifts the new element up from the
+/// minimum's leaf, and a tournament tree over the leaves finds the next
+/// minimum in O(log k), for two 32 bit indices per leaf; queues with fewer
+/// than 64 leaves rescan their leaves instead.
+///
+/// Priorities are the keys given by Projection, ordered by Compare. Unless
+/// Projection is std::identity, the key of an element is computed once when
+/// it is pushed and stored next to it, and all comparisons use the stored
+/// key.
+///
+/// In lazy mode (see set_lazy) push only appends, and the heap is built when
+/// the contents are first read. With a beam (see set_beam) elements too far
+/// below the best one are dropped as well. In either mode the const reads,
+/// top(), bottom(), size(), empty() and iteration, may reorganize the
+/// storage first, so concurrent reads need the same lock as writes.
+///
+/// With an InlineCapacity the first InlineCapacity elements are stored in
+/// the queue object itself, and memory is allocated only for queues that
+/// grow beyond that, or that are large enough for the tournament tree.
+template<typename T, typename Compare = std::less<T>, size_t Arity = 2,
+         typename Projection = std::identity, size_t InlineCapacity = 0>
 class fixed_size_priority_queue
 {
+    typedef fspq_detail::element_traits<T, Projection> traits;
+    // Compares stored elements; a reference to cmp for std::identity.
+    typedef typename traits::template compare<Compare>::type stored_compare;
+    typedef fspq_detail::reverse_compare<typename std::remove_reference<stored_compare>::type>
+        reverse_stored_compare;
+
   public:
-    fixed_size_priority_queue() : max_size_(0) {}
-    fixed_size_priority_queue(size_t max_size) : max_size_(max_size) {}
+    typedef typename traits::key_type key_type;
+    typedef typename traits::stored_type stored_type;
+    typedef fspq_detail::child_aligned_allocator<stored_type> allocator_type;
+    typedef typename std::conditional<
+        InlineCapacity == 0, std::vector<stored_type, allocator_type>,
+        fspq_detail::small_vector<stored_type, InlineCapacity, allocator_type> >::type container_type;
+
+    fixed_size_priority_queue()
+        : max_size_(0), lazy_(false), heap_ordered_(true), has_threshold_(false),
+          threshold_index_(0), has_leaf_tree_(false), has_beam_(false), has_best_(false),
+          beam_dirty_(false), beam_(), best_() {}
+    fixed_size_priority_queue(size_t max_size)
+        : max_size_(max_size), lazy_(false), heap_ordered_(true), has_threshold_(false),
+          threshold_index_(0), has_leaf_tree_(false), has_beam_(false), has_best_(false),
+          beam_dirty_(false), beam_(), best_() {}
+    /// Takes the comparator (and projection) to use, for lambdas and
+    /// comparators with parameters. Stateless ones take no space.
+    fixed_size_priority_queue(size_t max_size, const Compare &compare,
+                              const Projection &projection = Projection())
+        : max_size_(max_size), cmp(compare), projection_(projection), lazy_(false),
+          heap_ordered_(true), has_threshold_(false), threshold_index_(0), has_leaf_tree_(false),
+          has_beam_(false), has_best_(false), beam_dirty_(false), beam_(), best_() {}
 
-    typedef typename std::vector<T>::iterator iterator;
-    iterator begin() { return c_.begin(); }
-    iterator end() { return c_.end(); }
+    typedef typename traits::template iterator<typename container_type::iterator>::type iterator;
+    iterator begin() { settle(); return iterator(c_.begin()); }
+    iterator end() { settle(); return iterator(c_.end()); }
 
     inline void push(const T &x) {
+      // x is copied into the queue only once it is accepted; until then the
+      // checks work on its key, which for std::identity is x itself.
+      typename traits::key_result key = traits::make_key(x, projection_);
+      if (has_beam_ && !track_best(key, typename std::is_arithmetic<key_type>::type()))
+        return;
+      if (lazy_ && !(heap_ordered_ && c_.size() < max_size_)) {
+        push_lazy(x, key);
+        return;
+      }
+      stored_compare lower(cmp);
       if(c_.size() == max_size_) {
-        typename std::vector<T>::iterator iterator_min = std::min_element(c_.begin(), c_.end(), cmp);
-        if(*iterator_min < x) {
-          *iterator_min = x;
-          std::make_heap(c_.begin(), c_.end(), cmp);
+        if (c_.empty())
+          return;
+        // The minimum is kept as the threshold, so that rejecting an element
+        // takes a single comparison.
+        if (!has_threshold_)
+          find_threshold();
+        if(cmp(traits::key(c_[threshold_index_]), key)) {
+          size_t leaf = threshold_index_;
+          c_[leaf] = traits::make(x, key);
+          fspq_detail::sift_up<Arity>(c_.begin(), leaf, lower);
+          replaced_leaf(leaf);
         }
       }
       else {
-        c_.push_back(x);
-        std::make_heap(c_.begin(), c_.end(), cmp);
+        c_.push_back(traits::make(x, key));
+        fspq_detail::sift_up<Arity>(c_.begin(), c_.size() - 1, lower);
       }
     }
 
     inline void pop() {
+      settle();
       if (c_.empty())
         return;
-      std::pop_heap(c_.begin(), c_.end(), cmp);
+      stored_compare lower(cmp);
+      fspq_detail::pop_heap<Arity>(c_.begin(), c_.size(), lower);
       c_.pop_back();
+      forget_threshold();
+      if (has_beam_)
+        reset_best(typename std::is_arithmetic<key_type>::type());
     }
 
     inline const T& top() const {
-      return c_.front();
+      settle();
+      return traits::value(c_.front());
+    }
+
+    /// The key of top().
+    inline const key_type& top_key() const {
+      settle();
+      return traits::key(c_.front());
+    }
+
+    /// The element with the lowest priority, which is the next to be evicted.
+    inline const T& bottom() const {
+      settle();
+      return traits::value(c_[has_threshold_ ? threshold_index_ : min_leaf()]);
     }
 
     inline const bool empty() const {
+      settle();
       return c_.empty();
     }
 
     inline const size_t size() const {
+      settle();
       return c_.size();
     }
 
+    /// Removes all elements and keeps the memory for reuse. For trivially
+    /// destructible elements this only resets the size.
+    inline void clear() {
+      c_.clear();
+      heap_ordered_ = true;
+      forget_threshold();
+      has_best_ = false;
+      beam_dirty_ = false;
+    }
+
+    inline void swap(fixed_size_priority_queue &other) {
+      using std::swap;
+      c_.swap(other.c_);
+      swap(max_size_, other.max_size_);
+      swap(cmp, other.cmp);
+      swap(projection_, other.projection_);
+      swap(lazy_, other.lazy_);
+      swap(heap_ordered_, other.heap_ordered_);
+      swap(has_threshold_, other.has_threshold_);
+      swap(threshold_index_, other.threshold_index_);
+      swap(has_leaf_tree_, other.has_leaf_tree_);
+      leaf_tree_.swap(other.leaf_tree_);
+      swap(has_beam_, other.has_beam_);
+      swap(has_best_, other.has_best_);
+      swap(beam_dirty_, other.beam_dirty_);
+      swap(beam_, other.beam_);
+      swap(best_, other.best_);
+    }
+
+    friend inline void swap(fixed_size_priority_queue &a, fixed_size_priority_queue &b) {
+      a.swap(b);
+    }
+
     inline void enlarge_max_size(size_t max_size) {
-      if (max_size_ < max_size)
+      if (max_size_ < max_size) {
         max_size_ = max_size;
+        forget_threshold();
+      }
+    }
+
+    /// Changes the maximum size. When it shrinks below the current size, the
+    /// best max_size elements are selected in linear time, the others are
+    /// written to evicted, and the memory they used is released.
+    template<typename OutputIterator>
+    OutputIterator set_max_size(size_t max_size, OutputIterator evicted) {
+      settle();
+      if (max_size < c_.size()) {
+        stored_compare lower(cmp);
+        reverse_stored_compare higher(lower);
+        std::nth_element(c_.begin(), c_.begin() + max_size, c_.end(), higher);
+        for (typename container_type::iterator it = c_.begin() + max_size; it != c_.end(); ++it)
+          *evicted++ = traits::value(*it);
+        c_.erase(c_.begin() + max_size, c_.end());
+        fspq_detail::make_heap<Arity>(c_.begin(), c_.size(), lower);
+        c_.shrink_to_fit();
+        leaf_tree_.clear();
+        leaf_tree_.shrink_to_fit();
+      }
+      max_size_ = max_size;
+      forget_threshold();
+      return evicted;
+    }
+
+    inline void set_max_size(size_t max_size) {
+      set_max_size(max_size, fspq_detail::discard_iterator());
+    }
+
+    /// Like set_max_size, but only ever makes the maximum size smaller.
+    template<typename OutputIterator>
+    OutputIterator shrink_max_size(size_t max_size, OutputIterator evicted) {
+      if (max_size < max_size_)
+        return set_max_size(max_size, evicted);
+      return evicted;
+    }
+
+    inline void shrink_max_size(size_t max_size) {
+      shrink_max_size(max_size, fspq_detail::discard_iterator());
+    }
+
+    /// Sets a score beam, for arithmetic keys: elements that rank below the
+    /// best element seen so far by more than beam are rejected with one
+    /// comparison, without touching the heap. Stored elements that fall out
+    /// of the beam when a new best arrives are purged on the next read.
+    inline void set_beam(const key_type &beam) {
+      static_assert(std::is_arithmetic<key_type>::value, "a beam needs arithmetic scores");
+      settle();
+      has_beam_ = true;
+      beam_ = beam;
+      reset_best(typename std::is_arithmetic<key_type>::type());
+      beam_dirty_ = has_best_;
+    }
+
+    inline void clear_beam() {
+      has_beam_ = false;
+      beam_dirty_ = false;
+    }
+
+    /// Switches lazy mode on or off. In lazy mode push appends to the
+    /// container without keeping heap order. Once it holds twice the maximum
+    /// size, the best elements are selected in linear time and the k-th best
+    /// becomes a threshold that rejects any element not above it without
+    /// storing it. The heap is built once, on the first top(), pop(), size()
+    /// or iteration, so streams that are read only at the end pay O(1)
+    /// amortized per push instead of O(log k).
+    inline void set_lazy(bool lazy) {
+      if (!lazy)
+        settle();
+      lazy_ = lazy;
     }
 
   protected:
-    std::vector<T> c_;
+    typedef typename std::conditional<std::is_arithmetic<key_type>::value, key_type, char>::type beam_type;
+
+    // Returns whether key is within the beam, and makes it the best if it is.
+    inline bool track_best(const key_type &key, std::true_type) {
+      if (!has_best_) {
+        best_ = key;
+        has_best_ = true;
+      }
+      else if (cmp(best_, key)) {
+        best_ = key;
+        beam_dirty_ = true;
+      }
+      else if (out_of_beam(key)) {
+        return false;
+      }
+      return true;
+    }
+    inline bool track_best(const key_type &, std::false_type) {
+      return true;
+    }
+
+    // Takes the best from the top of the heap.
+    inline void reset_best(std::true_type) {
+      has_best_ = !c_.empty();
+      if (has_best_)
+        best_ = traits::key(c_.front());
+    }
+    inline void reset_best(std::false_type) {}
+
+    inline bool out_of_beam(const beam_type &key) const {
+      return cmp(key, best_) && (key < best_ ? best_ - key : key - best_) > beam_;
+    }
+
+    /// Drops the stored elements that fell out of the beam.
+    inline void purge_beam(std::true_type) const {
+      size_t n = c_.size();
+      c_.erase(std::remove_if(c_.begin(), c_.end(),
+                              [this](const stored_type &s) { return out_of_beam(traits::key(s)); }),
+               c_.end());
+      if (c_.size() != n) {
+        heap_ordered_ = false;
+        forget_threshold();
+      }
+      beam_dirty_ = false;
+    }
+    inline void purge_beam(std::false_type) const {
+      beam_dirty_ = false;
+    }
+
+    inline void push_lazy(const T &x, const key_type &key) {
+      if (max_size_ == 0)
+        return;
+      // The minimum of a full heap already bounds the k-th best.
+      if (!has_threshold_ && heap_ordered_ && c_.size() == max_size_) {
+        threshold_index_ = min_leaf();
+        has_threshold_ = true;
+      }
+      if (has_threshold_ && !cmp(traits::key(c_[threshold_index_]), key))
+        return;
+      c_.push_back(traits::make(x, key));
+      heap_ordered_ = false;
+      has_leaf_tree_ = false;
+      if (c_.size() >= 2 * max_size_)
+        prune();
+    }
+
+    /// Keeps the max_size_ best elements, in no particular order, and
+    /// remembers the lowest of them as the threshold.
+    inline void prune() const {
+      stored_compare lower(cmp);
+      reverse_stored_compare higher(lower);
+      std::nth_element(c_.begin(), c_.begin() + (max_size_ - 1), c_.end(), higher);
+      c_.erase(c_.begin() + max_size_, c_.end());
+      threshold_index_ = max_size_ - 1;
+      has_threshold_ = true;
+      has_leaf_tree_ = false;
+    }
+
+    /// Restores heap order after lazy pushes, and applies the beam.
+    inline void settle() const {
+      if (beam_dirty_)
+        purge_beam(typename std::is_arithmetic<key_type>::type());
+      if (heap_ordered_)
+        return;
+      if (c_.size() > max_size_)
+        prune();
+      stored_compare lower(cmp);
+      fspq_detail::make_heap<Arity>(c_.begin(), c_.size(), lower);
+      has_leaf_tree_ = false;
+      if (has_threshold_)
+        threshold_index_ = min_leaf();
+      heap_ordered_ = true;
+    }
+
+    /// The minimum of a max-heap is one of its leaves.
+    inline size_t min_leaf() const {
+      stored_compare lower(cmp);
+      return std::min_element(c_.begin() + fspq_detail::first_leaf<Arity>(c_.size()),
+                              c_.end(), lower) - c_.begin();
+    }
+
+    inline void forget_threshold() const {
+      has_threshold_ = false;
+      has_leaf_tree_ = false;
+    }
+
+    /// Makes the minimum of a full heap the threshold. Large heaps build a
+    /// tournament tree over their leaves for it: leaf_tree_[p] holds the
+    /// lower leaf of its children 2p and 2p + 1, as an offset from the first
+    /// leaf, the leaves themselves are at n_leaves + offset, and the root is
+    /// leaf_tree_[1].
+    inline void find_threshold() const {
+      size_t first = fspq_detail::first_leaf<Arity>(c_.size());
+      size_t n_leaves = c_.size() - first;
+      has_threshold_ = true;
+      if (n_leaves < min_tree_leaves || c_.size() > UINT32_MAX) {
+        threshold_index_ = min_leaf();
+        return;
+      }
+      leaf_tree_.resize(2 * n_leaves);
+      for (size_t i = 0; i < n_leaves; ++i)
+        leaf_tree_[n_leaves + i] = static_cast<uint32_t>(i);
+      for (size_t p = n_leaves - 1; p > 0; --p)
+        leaf_tree_[p] = lower_leaf(first, leaf_tree_[2 * p], leaf_tree_[2 * p + 1]);
+      threshold_index_ = first + leaf_tree_[1];
+      has_leaf_tree_ = true;
+    }
+
+    /// Updates the threshold after the element at leaf was replaced and
+    /// sifted up. That only moved elements on the path above leaf, so leaf
+    /// is the only one of the leaves that changed, and the tree finds the
+    /// new minimum in O(log k).
+    inline void replaced_leaf(size_t leaf) {
+      if (!has_leaf_tree_) {
+        has_threshold_ = false;
+        return;
+      }
+      size_t first = fspq_detail::first_leaf<Arity>(c_.size());
+      size_t n_leaves = c_.size() - first;
+      for (size_t p = (n_leaves + leaf - first) / 2; p > 0; p /= 2)
+        leaf_tree_[p] = lower_leaf(first, leaf_tree_[2 * p], leaf_tree_[2 * p + 1]);
+      threshold_index_ = first + leaf_tree_[1];
+    }
+
+    inline uint32_t lower_leaf(size_t first, uint32_t a, uint32_t b) const {
+      return cmp(traits::key(c_[first + b]), traits::key(c_[first + a])) ? b : a;
+    }
+
+    // Smaller heaps find their minimum by scanning the leaves.
+    static constexpr size_t min_tree_leaves = 64;
+
+    mutable container_type c_;
     size_t max_size_;
-    Compare cmp;
+    [[no_unique_address]] mutable Compare cmp;
+    [[no_unique_address]] Projection projection_;
+
+    bool lazy_;
+    mutable bool heap_ordered_;
+    mutable bool has_threshold_;
+    mutable size_t threshold_index_;
+    mutable bool has_leaf_tree_;
+    mutable std::vector<uint32_t> leaf_tree_;
+
+    bool has_beam_;
+    bool has_best_;
+    mutable bool beam_dirty_;
+    beam_type beam_;
+    beam_type best_;
+
+    static_assert(Arity >= 2, "a heap needs at least two children per node");
 
   private:
     // heap allocation is not allowed
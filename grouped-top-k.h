@@ -0,0 +1,182 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GROUPED_TOP_K_H_
+#define GROUPED_TOP_K_H_
+
+#include <algorithm>
+#include <functional>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+#include "fixed-size-priority-queue.h"
+
+/// The K elements with the highest priority of every group of a stream,
+/// for streams with very many groups.
+///
+/// All groups share one slab of K-slot blocks, block g holding the elements
+/// of the g-th group seen, so a new group costs no allocation of its own and
+/// iterating over all groups walks one contiguous array. Inside a block the
+/// elements form a min-heap, with the next one to evict at the front. Groups
+/// are found through an open addressing hash table of group numbers.
+///
+/// clear() keeps all memory. Hash table entries carry the generation they
+/// were written in, and clearing starts a new generation instead of wiping
+/// the table, so reusing the container per batch costs neither allocation
+/// nor a pass over the table.
+template<typename Key, typename T, size_t K, typename Compare = std::less<T>,
+         typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key> >
+class grouped_top_k
+{
+  public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    grouped_top_k() : mask_(0), generation_(1) {}
+    grouped_top_k(const Compare &compare) : mask_(0), generation_(1), cmp(compare) {}
+
+    /// Offers x to the group of key.
+    inline void push(const Key &key, const T &x) {
+      size_t g = find_or_insert(key);
+      T *first = &slab_[g * K];
+      fspq_detail::reverse_compare<Compare> higher(cmp);
+      uint32_t &n = sizes_[g];
+      if (n < K) {
+        first[n] = x;
+        fspq_detail::sift_up<2>(first, n++, higher);
+      }
+      else if (cmp(first[0], x)) {
+        first[0] = x;
+        fspq_detail::sift_down<2>(first, K, 0, higher);
+      }
+    }
+
+    /// Number of groups.
+    inline const size_t size() const {
+      return keys_.size();
+    }
+
+    inline const bool empty() const {
+      return keys_.empty();
+    }
+
+    /// Number of the group of key, or npos.
+    inline size_t find(const Key &key) const {
+      if (keys_.empty())
+        return npos;
+      for (size_t i = hash(key) & mask_; table_[i].generation == generation_; i = (i + 1) & mask_) {
+        if (equal(keys_[table_[i].group], key))
+          return table_[i].group;
+      }
+      return npos;
+    }
+
+    /// Removes all groups in constant time for trivially destructible keys.
+    /// The slab and the hash table are kept for the next groups.
+    inline void clear() {
+      keys_.clear();
+      sizes_.clear();
+      if (++generation_ == 0) {
+        for (size_t i = 0; i < table_.size(); ++i)
+          table_[i].generation = 0;
+        generation_ = 1;
+      }
+    }
+
+    inline const Key &key(size_t g) const {
+      return keys_[g];
+    }
+
+    /// The elements of group g, in no particular order.
+    inline const T *group_begin(size_t g) const {
+      return &slab_[g * K];
+    }
+    inline const T *group_end(size_t g) const {
+      return &slab_[g * K] + sizes_[g];
+    }
+    inline const size_t group_size(size_t g) const {
+      return sizes_[g];
+    }
+
+    /// Writes the elements of group g to out, highest priority first.
+    template<typename OutputIterator>
+    OutputIterator ranked(size_t g, OutputIterator out) const {
+      T sorted[K];
+      std::copy(group_begin(g), group_end(g), sorted);
+      fspq_detail::reverse_compare<Compare> higher(cmp);
+      std::sort(sorted, sorted + sizes_[g], higher);
+      return std::copy(sorted, sorted + sizes_[g], out);
+    }
+
+  protected:
+    inline size_t hash(const Key &key) const {
+      // Fibonacci hashing spreads weak hashes such as the identity on ints.
+      return static_cast<size_t>((static_cast<uint64_t>(hasher(key)) * 0x9e3779b97f4a7c15ull) >> 17);
+    }
+
+    inline size_t find_or_insert(const Key &key) {
+      if (2 * (keys_.size() + 1) > table_.size())
+        rehash(std::max<size_t>(16, 2 * table_.size()));
+      size_t i = hash(key) & mask_;
+      for (; table_[i].generation == generation_; i = (i + 1) & mask_) {
+        if (equal(keys_[table_[i].group], key))
+          return table_[i].group;
+      }
+      size_t g = keys_.size();
+      keys_.push_back(key);
+      sizes_.push_back(0);
+      if (slab_.size() < (g + 1) * K)
+        slab_.resize((g + 1) * K);
+      table_[i].generation = generation_;
+      table_[i].group = static_cast<uint32_t>(g);
+      return g;
+    }
+
+    void rehash(size_t capacity) {
+      entry empty = {0, 0};
+      table_.assign(capacity, empty);
+      generation_ = 1;
+      mask_ = capacity - 1;
+      for (size_t g = 0; g < keys_.size(); ++g) {
+        size_t i = hash(keys_[g]) & mask_;
+        while (table_[i].generation == generation_)
+          i = (i + 1) & mask_;
+        table_[i].generation = generation_;
+        table_[i].group = static_cast<uint32_t>(g);
+      }
+    }
+
+    // A slot of the hash table holds a group if its generation is current.
+    struct entry
+    {
+      uint32_t generation;
+      uint32_t group;
+    };
+
+    std::vector<T> slab_;
+    std::vector<uint32_t> sizes_;
+    std::vector<Key> keys_;
+    std::vector<entry> table_;
+    size_t mask_;
+    uint32_t generation_;
+    [[no_unique_address]] mutable Compare cmp;
+    [[no_unique_address]] Hash hasher;
+    [[no_unique_address]] KeyEqual equal;
+
+    static_assert(std::is_default_constructible<T>::value,
+                  "grouped_top_k preallocates the slots of each group");
+};
+
+#endif  // GROUPED_TOP_K_H_
@@ -0,0 +1,132 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HISTOGRAM_PRUNER_H_
+#define HISTOGRAM_PRUNER_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+/// Computes an approximate pruning cutoff for a batch of scores, keeping
+/// roughly the max_active highest ones, without maintaining a heap.
+///
+/// Scores are pushed while a batch is collected, which also tracks their
+/// range. cutoff() then sorts them into equal width buckets in one pass and
+/// walks the buckets down from the highest until max_active scores are
+/// covered. The result is the lower edge of that bucket: at least max_active
+/// scores are >= the cutoff, and the cutoff is less than one bucket width,
+/// at most max_error, below the exact max_active-th best score. When the
+/// range is too wide for max_error with max_buckets buckets, the buckets
+/// get wider and the bound loosens accordingly; a max_error that is not
+/// positive always uses max_buckets buckets.
+template<typename Score = float>
+class histogram_pruner
+{
+  public:
+    histogram_pruner(size_t max_active, Score max_error, size_t max_buckets = 4096)
+        : max_active_(max_active), max_error_(max_error), max_buckets_(max_buckets) {
+      clear();
+    }
+
+    inline void push(Score score) {
+      scores_.push_back(score);
+      lowest_ = std::min(lowest_, score);
+      highest_ = std::max(highest_, score);
+    }
+
+    template<typename InputIterator>
+    inline void push(InputIterator first, InputIterator last) {
+      for (; first != last; ++first)
+        push(*first);
+    }
+
+    /// Starts a new batch. The memory of the previous one is kept.
+    inline void clear() {
+      scores_.clear();
+      lowest_ = std::numeric_limits<Score>::max();
+      highest_ = std::numeric_limits<Score>::lowest();
+    }
+
+    inline const size_t size() const {
+      return scores_.size();
+    }
+
+    inline const bool empty() const {
+      return scores_.empty();
+    }
+
+    /// Returns the cutoff for the current batch. If the batch holds no more
+    /// than max_active scores, nothing needs to be pruned and the lowest
+    /// score is returned. A max_active of 0 prunes everything: the cutoff is
+    /// the next value above the highest score. Only a highest score with
+    /// nothing above it, infinity or the largest integer, still passes.
+    Score cutoff() {
+      if (scores_.size() <= max_active_)
+        return lowest_;
+      if (max_active_ == 0) {
+        if (!std::numeric_limits<Score>::is_integer) {
+          return static_cast<Score>(
+              std::nextafter(highest_, std::numeric_limits<Score>::infinity()));
+        }
+        return highest_ < std::numeric_limits<Score>::max() ? highest_ + 1 : highest_;
+      }
+      double range = static_cast<double>(highest_) - static_cast<double>(lowest_);
+      // Compared as a double, so that a tiny or non-positive max_error never
+      // casts an out of range value to size_t.
+      double wanted = range / max_error_;
+      size_t n_buckets = max_error_ > 0 && wanted < static_cast<double>(max_buckets_)
+                             ? static_cast<size_t>(wanted) + 1 : max_buckets_;
+      double width = range / n_buckets;
+      if (width <= 0)
+        return lowest_;
+      counts_.assign(n_buckets, 0);
+      double scale = 1.0 / width;
+      for (size_t i = 0; i < scores_.size(); ++i) {
+        size_t bucket = static_cast<size_t>((scores_[i] - lowest_) * scale);
+        ++counts_[std::min(bucket, n_buckets - 1)];
+      }
+      size_t covered = 0;
+      size_t bucket = n_buckets;
+      while (bucket > 0 && covered < max_active_)
+        covered += counts_[--bucket];
+      double edge = lowest_ + bucket * width;
+      Score cutoff = static_cast<Score>(edge);
+      if (cutoff > edge) {
+        cutoff = std::numeric_limits<Score>::is_integer
+                     ? cutoff - 1 : static_cast<Score>(std::nextafter(cutoff, lowest_));
+      }
+      return std::max(cutoff, lowest_);
+    }
+
+    /// Width of the buckets used by the last cutoff(), which bounds its error.
+    inline double bucket_width() const {
+      if (counts_.empty())
+        return 0;
+      return (static_cast<double>(highest_) - static_cast<double>(lowest_)) / counts_.size();
+    }
+
+  protected:
+    size_t max_active_;
+    Score max_error_;
+    size_t max_buckets_;
+    std::vector<Score> scores_;
+    std::vector<size_t> counts_;
+    Score lowest_;
+    Score highest_;
+};
+
+#endif  // HISTOGRAM_PRUNER_H_
@@ -0,0 +1,217 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYED_FIXED_SIZE_PRIORITY_QUEUE_H_
+#define KEYED_FIXED_SIZE_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// A fixed size priority queue for large elements, laid out as a
+/// struct of arrays. The priority of an element is the key extracted from it
+/// by KeyOf, and only the keys take part in the heap: a dense array of keys
+/// and a parallel array of slot indices are kept in heap order, while the
+/// elements themselves stay in their slots. An element is copied exactly once,
+/// when it is accepted into the queue.
+template<typename T, typename KeyOf,
+         typename Compare = std::less<typename std::decay<decltype(
+             std::declval<KeyOf&>()(std::declval<const T &>()))>::type> >
+class keyed_fixed_size_priority_queue
+{
+  public:
+    typedef typename std::decay<decltype(
+        std::declval<KeyOf&>()(std::declval<const T &>()))>::type key_type;
+    typedef uint32_t slot_type;
+
+    keyed_fixed_size_priority_queue()
+        : max_size_(0), has_threshold_(false), threshold_index_(0) {}
+    keyed_fixed_size_priority_queue(size_t max_size)
+        : max_size_(max_size), has_threshold_(false), threshold_index_(0) {
+      keys_.reserve(max_size);
+      slots_.reserve(max_size);
+      payload_.reserve(max_size);
+    }
+    keyed_fixed_size_priority_queue(size_t max_size, const KeyOf &key_of,
+                                    const Compare &compare = Compare())
+        : max_size_(max_size), has_threshold_(false), threshold_index_(0),
+          key_of(key_of), cmp(compare) {
+      keys_.reserve(max_size);
+      slots_.reserve(max_size);
+      payload_.reserve(max_size);
+    }
+
+    /// Iterates over the elements in heap order.
+    class iterator
+    {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef T* pointer;
+        typedef T& reference;
+
+        iterator(keyed_fixed_size_priority_queue *q, size_t i) : q_(q), i_(i) {}
+        reference operator*() const { return q_->payload_[q_->slots_[i_]]; }
+        pointer operator->() const { return &**this; }
+        iterator &operator++() { ++i_; return *this; }
+        iterator operator++(int) { iterator it = *this; ++i_; return it; }
+        bool operator==(const iterator &other) const { return i_ == other.i_; }
+        bool operator!=(const iterator &other) const { return i_ != other.i_; }
+
+      private:
+        keyed_fixed_size_priority_queue *q_;
+        size_t i_;
+    };
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, keys_.size()); }
+
+    inline void push(const T &x) {
+      key_type key = key_of(x);
+      if (keys_.size() == max_size_) {
+        if (keys_.empty())
+          return;
+        // The minimum is kept as the threshold until it gets replaced, so
+        // that rejecting an element takes a single comparison.
+        if (!has_threshold_) {
+          threshold_index_ = min_leaf();
+          has_threshold_ = true;
+        }
+        if (cmp(keys_[threshold_index_], key)) {
+          payload_[slots_[threshold_index_]] = x;
+          keys_[threshold_index_] = key;
+          sift_up(threshold_index_);
+          has_threshold_ = false;
+        }
+      }
+      else {
+        slot_type slot;
+        if (free_.empty()) {
+          slot = static_cast<slot_type>(payload_.size());
+          payload_.push_back(x);
+        }
+        else {
+          slot = free_.back();
+          free_.pop_back();
+          payload_[slot] = x;
+        }
+        keys_.push_back(key);
+        slots_.push_back(slot);
+        sift_up(keys_.size() - 1);
+      }
+    }
+
+    inline void pop() {
+      if (keys_.empty())
+        return;
+      free_.push_back(slots_.front());
+      keys_.front() = keys_.back();
+      slots_.front() = slots_.back();
+      keys_.pop_back();
+      slots_.pop_back();
+      has_threshold_ = false;
+      if (!keys_.empty())
+        sift_down(0);
+    }
+
+    inline const T& top() const {
+      return payload_[slots_.front()];
+    }
+
+    inline const key_type& top_key() const {
+      return keys_.front();
+    }
+
+    inline const bool empty() const {
+      return keys_.empty();
+    }
+
+    inline const size_t size() const {
+      return keys_.size();
+    }
+
+    inline void enlarge_max_size(size_t max_size) {
+      if (max_size_ < max_size) {
+        max_size_ = max_size;
+        has_threshold_ = false;
+      }
+    }
+
+  protected:
+    /// The minimum of a max-heap is one of its leaves.
+    size_t min_leaf() const {
+      size_t i_min = keys_.size() / 2;
+      for (size_t i = i_min + 1; i < keys_.size(); ++i) {
+        if (cmp(keys_[i], keys_[i_min]))
+          i_min = i;
+      }
+      return i_min;
+    }
+
+    void sift_up(size_t i) {
+      key_type key = keys_[i];
+      slot_type slot = slots_[i];
+      while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!cmp(keys_[parent], key))
+          break;
+        keys_[i] = keys_[parent];
+        slots_[i] = slots_[parent];
+        i = parent;
+      }
+      keys_[i] = key;
+      slots_[i] = slot;
+    }
+
+    void sift_down(size_t i) {
+      size_t n = keys_.size();
+      key_type key = keys_[i];
+      slot_type slot = slots_[i];
+      for (size_t child = 2 * i + 1; child < n; child = 2 * i + 1) {
+        if (child + 1 < n && cmp(keys_[child], keys_[child + 1]))
+          ++child;
+        if (!cmp(key, keys_[child]))
+          break;
+        keys_[i] = keys_[child];
+        slots_[i] = slots_[child];
+        i = child;
+      }
+      keys_[i] = key;
+      slots_[i] = slot;
+    }
+
+    std::vector<key_type> keys_;
+    std::vector<slot_type> slots_;
+    std::vector<T> payload_;
+    std::vector<slot_type> free_;
+    size_t max_size_;
+    bool has_threshold_;
+    size_t threshold_index_;
+    [[no_unique_address]] KeyOf key_of;
+    [[no_unique_address]] mutable Compare cmp;
+
+  private:
+    // heap allocation is not allowed
+    void * operator new   (size_t);
+    void * operator new[] (size_t);
+    void   operator delete   (void *);
+    void   operator delete[] (void*);
+};
+
+#endif  // KEYED_FIXED_SIZE_PRIORITY_QUEUE_H_
@@ -0,0 +1,214 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PACKED_SCORE_ID_PRIORITY_QUEUE_H_
+#define PACKED_SCORE_ID_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+namespace fspq_detail {
+
+/// Maps a float to an unsigned integer with the same ordering: non-negative
+/// values get the sign bit set, negative values have all their bits flipped.
+/// -0.0 maps to the same integer as +0.0, as the two compare equal.
+inline uint32_t float_to_ordered(float f) {
+  if (f == 0)
+    f = 0;
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits ^ ((bits & 0x80000000u) ? 0xffffffffu : 0x80000000u);
+}
+
+inline float ordered_to_float(uint32_t u) {
+  uint32_t bits = u ^ ((u & 0x80000000u) ? 0x80000000u : 0xffffffffu);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+inline uint64_t pack_score_id(float score, uint32_t id) {
+  return (static_cast<uint64_t>(float_to_ordered(score)) << 32) | id;
+}
+
+inline std::pair<float, uint32_t> unpack_score_id(uint64_t key) {
+  return std::make_pair(ordered_to_float(static_cast<uint32_t>(key >> 32)),
+                        static_cast<uint32_t>(key));
+}
+
+}  // namespace fspq_detail
+
+/// A fixed size priority queue of (score, id) pairs, ordered like
+/// fixed_size_priority_queue<std::pair<float, uint32_t> >: by score, then by
+/// id. Each pair is packed into a single uint64_t, score in the high half,
+/// so that the heap works on plain integer compares and the elements take 8
+/// bytes each. Pairs are unpacked only when they are read back through top()
+/// or the iterators, which is why those return them by value. NaN scores are
+/// not supported.
+class packed_score_id_priority_queue
+{
+  public:
+    typedef std::pair<float, uint32_t> value_type;
+
+    packed_score_id_priority_queue() : max_size_(0), min_key_(0), has_min_(false) {}
+    packed_score_id_priority_queue(size_t max_size)
+        : max_size_(max_size), min_key_(0), has_min_(false) {
+      c_.reserve(max_size);
+    }
+
+    class iterator
+    {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<float, uint32_t> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef value_type reference;
+
+        iterator(std::vector<uint64_t>::const_iterator it) : it_(it) {}
+        value_type operator*() const { return fspq_detail::unpack_score_id(*it_); }
+        iterator &operator++() { ++it_; return *this; }
+        iterator operator++(int) { iterator it = *this; ++it_; return it; }
+        bool operator==(const iterator &other) const { return it_ == other.it_; }
+        bool operator!=(const iterator &other) const { return it_ != other.it_; }
+
+      private:
+        std::vector<uint64_t>::const_iterator it_;
+    };
+    iterator begin() const { return iterator(c_.begin()); }
+    iterator end() const { return iterator(c_.end()); }
+
+    inline void push(const value_type &x) {
+      push(x.first, x.second);
+    }
+
+    inline void push(float score, uint32_t id) {
+      push_packed(fspq_detail::pack_score_id(score, id));
+    }
+
+    inline void pop() {
+      if (c_.empty())
+        return;
+      std::pop_heap(c_.begin(), c_.end());
+      c_.pop_back();
+      has_min_ = false;
+    }
+
+    inline value_type top() const {
+      return fspq_detail::unpack_score_id(c_.front());
+    }
+
+    /// The pair with the lowest priority, which is the next to be evicted.
+    inline value_type bottom() const {
+      return fspq_detail::unpack_score_id(min_key());
+    }
+
+    inline const bool empty() const {
+      return c_.empty();
+    }
+
+    inline const size_t size() const {
+      return c_.size();
+    }
+
+    /// Removes all pairs and keeps the memory for reuse.
+    inline void clear() {
+      c_.clear();
+      has_min_ = false;
+    }
+
+    inline void swap(packed_score_id_priority_queue &other) {
+      c_.swap(other.c_);
+      std::swap(max_size_, other.max_size_);
+      std::swap(min_key_, other.min_key_);
+      std::swap(has_min_, other.has_min_);
+    }
+
+    friend inline void swap(packed_score_id_priority_queue &a, packed_score_id_priority_queue &b) {
+      a.swap(b);
+    }
+
+    inline void enlarge_max_size(size_t max_size) {
+      if (max_size_ < max_size)
+        max_size_ = max_size;
+    }
+
+    /// Changes the maximum size, keeping the best pairs if it shrinks.
+    inline void set_max_size(size_t max_size) {
+      if (max_size < c_.size()) {
+        std::nth_element(c_.begin(), c_.begin() + max_size, c_.end(),
+                         std::greater<uint64_t>());
+        c_.erase(c_.begin() + max_size, c_.end());
+        std::make_heap(c_.begin(), c_.end());
+        has_min_ = false;
+      }
+      max_size_ = max_size;
+    }
+
+  protected:
+    inline void push_packed(uint64_t key) {
+      if (c_.size() == max_size_) {
+        if (c_.empty())
+          return;
+        if (min_key() < key) {
+          std::vector<uint64_t>::iterator it =
+              std::find(c_.begin() + c_.size() / 2, c_.end(), min_key_);
+          *it = key;
+          std::push_heap(c_.begin(), it + 1);
+          has_min_ = false;
+        }
+      }
+      else {
+        c_.push_back(key);
+        std::push_heap(c_.begin(), c_.end());
+        has_min_ = false;
+      }
+    }
+
+    // The minimum of a max-heap is one of its leaves. The reduction is a
+    // branch free loop over integers, which compilers vectorize. It is kept
+    // until the heap changes.
+    inline uint64_t min_key() const {
+      if (!has_min_) {
+        const uint64_t *leaves = c_.data() + c_.size() / 2;
+        size_t n_leaves = c_.size() - c_.size() / 2;
+        uint64_t min_key = leaves[0];
+        for (size_t i = 1; i < n_leaves; ++i)
+          min_key = leaves[i] < min_key ? leaves[i] : min_key;
+        min_key_ = min_key;
+        has_min_ = true;
+      }
+      return min_key_;
+    }
+
+    std::vector<uint64_t> c_;
+    size_t max_size_;
+    mutable uint64_t min_key_;
+    mutable bool has_min_;
+
+  private:
+    // heap allocation is not allowed
+    void * operator new   (size_t);
+    void * operator new[] (size_t);
+    void   operator delete   (void *);
+    void   operator delete[] (void*);
+};
+
+#endif  // PACKED_SCORE_ID_PRIORITY_QUEUE_H_
@@ -0,0 +1,167 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RUNNING_QUANTILE_H_
+#define RUNNING_QUANTILE_H_
+
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+/// Tracks one quantile of the last window values pushed, such as the p99
+/// latency of the last 10000 requests, in fixed memory.
+///
+/// The window is a ring of values. Their positions in the ring are kept in
+/// two heaps: a max-heap of the lowest rank + 1 values, whose top is the
+/// quantile, and a min-heap of the others. Every ring position records where
+/// in which heap it is, so the value that falls out of the window is removed
+/// directly. push is O(log window), quantile() is O(1). For several
+/// quantiles use one tracker each.
+template<typename T, typename Compare = std::less<T> >
+class running_quantile
+{
+  public:
+    /// Tracks the value of rank floor(q * (n - 1)) among the last n <= window
+    /// values, counted from the lowest; q = 0.5 is the (lower) median. q is
+    /// clamped to [0, 1].
+    running_quantile(size_t window, double q, const Compare &compare = Compare())
+        : values_(window), heap_of_(window), index_(window), q_(q > 1 ? 1 : q > 0 ? q : 0),
+          next_(0), size_(0), cmp(compare) {
+      lower_.reserve(window);
+      upper_.reserve(window);
+    }
+
+    inline void push(const T &x) {
+      if (values_.empty())
+        return;
+      uint32_t slot = static_cast<uint32_t>(next_);
+      if (size_ == values_.size())
+        erase(heap_of_[slot], index_[slot]);
+      else
+        ++size_;
+      values_[slot] = x;
+      if (!lower_.empty() && !cmp(values_[lower_[0]], x))
+        insert(LOWER, slot);
+      else
+        insert(UPPER, slot);
+      rebalance();
+      next_ = next_ + 1 == values_.size() ? 0 : next_ + 1;
+    }
+
+    /// The current quantile. The window must not be empty.
+    inline const T& quantile() const {
+      return values_[lower_[0]];
+    }
+
+    inline const bool empty() const {
+      return size_ == 0;
+    }
+
+    /// Number of values in the window.
+    inline const size_t size() const {
+      return size_;
+    }
+
+  protected:
+    enum heap_id { LOWER = 0, UPPER = 1 };
+
+    inline std::vector<uint32_t> &heap(uint8_t h) {
+      return h == LOWER ? lower_ : upper_;
+    }
+
+    // Whether slot a belongs above slot b in heap h.
+    inline bool above(uint8_t h, uint32_t a, uint32_t b) {
+      return h == LOWER ? cmp(values_[b], values_[a]) : cmp(values_[a], values_[b]);
+    }
+
+    inline void place(uint8_t h, size_t i, uint32_t slot) {
+      heap(h)[i] = slot;
+      heap_of_[slot] = h;
+      index_[slot] = static_cast<uint32_t>(i);
+    }
+
+    void sift_up(uint8_t h, size_t i) {
+      std::vector<uint32_t> &c = heap(h);
+      uint32_t slot = c[i];
+      while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!above(h, slot, c[parent]))
+          break;
+        place(h, i, c[parent]);
+        i = parent;
+      }
+      place(h, i, slot);
+    }
+
+    void sift_down(uint8_t h, size_t i) {
+      std::vector<uint32_t> &c = heap(h);
+      size_t n = c.size();
+      uint32_t slot = c[i];
+      for (size_t child = 2 * i + 1; child < n; child = 2 * i + 1) {
+        if (child + 1 < n && above(h, c[child + 1], c[child]))
+          ++child;
+        if (!above(h, c[child], slot))
+          break;
+        place(h, i, c[child]);
+        i = child;
+      }
+      place(h, i, slot);
+    }
+
+    inline void insert(uint8_t h, uint32_t slot) {
+      heap(h).push_back(slot);
+      sift_up(h, heap(h).size() - 1);
+    }
+
+    /// Removes the element at index i of heap h.
+    void erase(uint8_t h, size_t i) {
+      std::vector<uint32_t> &c = heap(h);
+      uint32_t last = c.back();
+      c.pop_back();
+      if (i == c.size())
+        return;
+      place(h, i, last);
+      sift_up(h, i);
+      sift_down(h, index_[last]);
+    }
+
+    /// Moves tops between the heaps until the lower one holds rank + 1.
+    void rebalance() {
+      size_t target = static_cast<size_t>(q_ * (size_ - 1)) + 1;
+      while (lower_.size() > target) {
+        uint32_t slot = lower_[0];
+        erase(LOWER, 0);
+        insert(UPPER, slot);
+      }
+      while (lower_.size() < target) {
+        uint32_t slot = upper_[0];
+        erase(UPPER, 0);
+        insert(LOWER, slot);
+      }
+    }
+
+    // The ring of values, and for every ring slot its heap and its index there.
+    std::vector<T> values_;
+    std::vector<uint8_t> heap_of_;
+    std::vector<uint32_t> index_;
+    std::vector<uint32_t> lower_;
+    std::vector<uint32_t> upper_;
+    double q_;
+    size_t next_;
+    size_t size_;
+    [[no_unique_address]] Compare cmp;
+};
+
+#endif  // RUNNING_QUANTILE_H_
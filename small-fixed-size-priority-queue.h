@@ -0,0 +1,154 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SMALL_FIXED_SIZE_PRIORITY_QUEUE_H_
+#define SMALL_FIXED_SIZE_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+
+#include "fixed-size-priority-queue.h"
+
+/// Largest capacity for which static_fixed_size_priority_queue picks the
+/// sorted array engine over the heap.
+const size_t small_fixed_size_priority_queue_max_capacity = 16;
+
+/// A priority queue with a small compile time capacity K. The elements are
+/// kept sorted in a fixed array, worst first, so top() and pop() work on the
+/// last element and an insertion is a rank computation plus a shift. For
+/// arithmetic T both are fixed trip count loops without data dependent
+/// branches, which compilers unroll and vectorize.
+template<typename T, size_t K, typename Compare = std::less<T> >
+class small_fixed_size_priority_queue
+{
+  public:
+    small_fixed_size_priority_queue() : c_(), size_(0) {}
+    explicit small_fixed_size_priority_queue(const Compare &compare)
+        : c_(), size_(0), cmp(compare) {}
+
+    /// Iterates from the highest priority to the lowest one.
+    typedef std::reverse_iterator<T*> iterator;
+    iterator begin() { return iterator(c_ + size_); }
+    iterator end() { return iterator(c_); }
+
+    inline void push(const T &x) {
+      // Number of stored elements with a lower priority than x; x goes right
+      // above them, and below any equal ones.
+      size_t rank = rank_of(x, typename std::is_arithmetic<T>::type());
+      if (size_ == K) {
+        if (rank == 0)
+          return;
+        // The lowest element drops out, the ones below x move down.
+        shift_down(rank, typename std::is_arithmetic<T>::type());
+        c_[rank - 1] = x;
+      }
+      else {
+        shift_up(rank, typename std::is_arithmetic<T>::type());
+        c_[rank] = x;
+        ++size_;
+      }
+    }
+
+    inline void pop() {
+      if (size_ > 0)
+        --size_;
+    }
+
+    inline const T& top() const {
+      return c_[size_ > 0 ? size_ - 1 : 0];
+    }
+
+    inline const bool empty() const {
+      return size_ == 0;
+    }
+
+    inline const size_t size() const {
+      return size_;
+    }
+
+  protected:
+    // Arithmetic slots past size_ hold stale but valid values, so all K are
+    // compared and the ones past size_ masked out. Other types compare only
+    // the stored elements: an empty slot may be a null pointer or a default
+    // constructed object the comparator can not handle.
+    inline size_t rank_of(const T &x, std::true_type) {
+      size_t rank = 0;
+      for (size_t i = 0; i < K; ++i)
+        rank += (i < size_) & cmp(c_[i], x);
+      return rank;
+    }
+    inline size_t rank_of(const T &x, std::false_type) {
+      size_t rank = 0;
+      for (size_t i = 0; i < size_; ++i)
+        rank += cmp(c_[i], x);
+      return rank;
+    }
+
+    // c_[0, rank) = c_[1, rank + 1)
+    inline void shift_down(size_t rank, std::true_type) {
+      for (size_t i = 0; i + 1 < K; ++i)
+        c_[i] = i + 1 < rank ? c_[i + 1] : c_[i];
+    }
+    inline void shift_down(size_t rank, std::false_type) {
+      std::copy(c_ + 1, c_ + rank, c_);
+    }
+
+    // c_[rank + 1, size_ + 1) = c_[rank, size_)
+    inline void shift_up(size_t rank, std::true_type) {
+      for (size_t i = K - 1; i > 0; --i)
+        c_[i] = (i > rank && i <= size_) ? c_[i - 1] : c_[i];
+    }
+    inline void shift_up(size_t rank, std::false_type) {
+      std::copy_backward(c_ + rank, c_ + size_, c_ + size_ + 1);
+    }
+
+    T c_[K];
+    size_t size_;
+    [[no_unique_address]] Compare cmp;
+
+  private:
+    // heap allocation is not allowed
+    void * operator new   (size_t);
+    void * operator new[] (size_t);
+    void   operator delete   (void *);
+    void   operator delete[] (void*);
+};
+
+namespace fspq_detail {
+
+template<typename T, size_t K, typename Compare>
+class static_capacity_priority_queue : public fixed_size_priority_queue<T, Compare>
+{
+  public:
+    static_capacity_priority_queue() : fixed_size_priority_queue<T, Compare>(K) {}
+    explicit static_capacity_priority_queue(const Compare &compare)
+        : fixed_size_priority_queue<T, Compare>(K, compare) {}
+};
+
+}  // namespace fspq_detail
+
+/// A priority queue with compile time capacity K. Small capacities use the
+/// sorted array engine, larger ones (and element types that can not live in
+/// a plain array) use the heap of fixed_size_priority_queue.
+template<typename T, size_t K, typename Compare = std::less<T> >
+using static_fixed_size_priority_queue = typename std::conditional<
+    (K > 0 && K <= small_fixed_size_priority_queue_max_capacity &&
+     std::is_default_constructible<T>::value),
+    small_fixed_size_priority_queue<T, K, Compare>,
+    fspq_detail::static_capacity_priority_queue<T, K, Compare> >::type;
+
+#endif  // SMALL_FIXED_SIZE_PRIORITY_QUEUE_H_
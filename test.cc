@@ -13,20 +13,60 @@
 // See the Apache 2 License for the specific language governing permissions and
 // limitations under the License.
 
+#include "argtopk.h"
+#include "async-fixed-size-priority-queue.h"
+#include "batched-argtopk.h"
+#include "decayed-fixed-size-priority-queue.h"
 #include "fixed-size-priority-queue.h"
+#include "fixed-size-priority-queue-pool.h"
+#include "grouped-top-k.h"
+#include "histogram-pruner.h"
+#include "blocked-fixed-size-priority-queue.h"
+#include "concurrent-fixed-size-priority-queue.h"
+#include "keyed-fixed-size-priority-queue.h"
+#include "packed-score-id-priority-queue.h"
+#include "running-quantile.h"
+#include "small-fixed-size-priority-queue.h"
+#include "weighted-reservoir.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
 using namespace std;
 
-template<typename T>
-void print_queue(fixed_size_priority_queue<T> &q) {
+class Foo {
+  public:
+    Foo (int a, float b) : a_(a), b_(b) {}
+  
+    friend inline std::ostream &operator<<(std::ostream &os, const Foo &foo) {
+      os << "(" << foo.a_ << ", " << foo.b_ << ")";
+      return os;    
+    }
+
+    inline bool operator< (const Foo &other) const {
+      return b_ < other.b_;
+    }
+
+  private:
+    int a_;
+    float b_;
+};
+
+struct FooPointerCmp {
+  bool operator() (Foo *i, Foo *j) { return *i < *j; }
+};
+
+template<typename Queue>
+void print_queue(Queue &q) {
     cout << "[size = " << q.size() << ", top = " << q.top() << "]";
-    for (typename fixed_size_priority_queue<T>::iterator it = q.begin(); it != q.end(); it++) {
+    for (typename Queue::iterator it = q.begin(); it != q.end(); it++) {
         cout << "\t" << *it;
     }
     cout << endl;
 }
 
-template<typename T>
-void do_test(fixed_size_priority_queue<T> &q) {
+template<typename Queue>
+void do_test(Queue &q) {
   print_queue(q);
   while (! q.empty()) {
     q.pop();
@@ -35,7 +75,7 @@ void do_test(fixed_size_priority_queue<T> &q) {
   cout << endl;
 }
 
-int test_simple() {
+void test_simple() {
   fixed_size_priority_queue<int> q_simple(5);
   q_simple.push(2);
   q_simple.push(3);
@@ -54,7 +94,7 @@ int test_simple() {
   do_test(q_simple);
 }
 
-int test_complex() {
+void test_complex() {
   fixed_size_priority_queue<Foo> q_complex(5);
   q_complex.push(Foo(2, 3));
   q_complex.push(Foo(3, 2));
@@ -69,29 +109,7 @@ int test_complex() {
   do_test(q_complex);
 }
 
-class Foo {
-  public:
-    Foo (int a, float b) : a_(a), b_(b) {}
-  
-    friend inline std::ostream &operator<<(std::ostream &os, const Foo &foo) {
-      os << "(" << foo.a_ << ", " << foo.b_ << ")";
-      return os;    
-    }
-
-    inline bool operator< (const Foo &other) const {
-      return b_ < other.b_;
-    }
-
-  private:
-    int a_;
-    float b_;
-};
-
-struct FooPointerCmp {
-  bool operator() (Foo *i, Foo *j) { return *i < *j; }
-};
-
-int test_pointer() {
+void test_pointer() {
   fixed_size_priority_queue<Foo*, FooPointerCmp> q_pointer(5);
   q_pointer.push(new Foo(2, 3));
   q_pointer.push(new Foo(3, 2));
@@ -112,8 +130,713 @@ int test_pointer() {
   do_test(q_pointer);
 }
 
+struct Record {
+  Record (float score, const string &name) : score(score), name(name) {}
+  float score;
+  string name;
+  char blob[200];
+};
+
+struct RecordScore {
+  float operator() (const Record &r) const { return r.score; }
+};
+
+void test_keyed() {
+  keyed_fixed_size_priority_queue<Record, RecordScore> q_keyed(3);
+  q_keyed.push(Record(2, "b"));
+  q_keyed.push(Record(3, "c"));
+  q_keyed.push(Record(1, "a"));
+  q_keyed.push(Record(5, "e"));
+  q_keyed.push(Record(4, "d"));
+  q_keyed.push(Record(0, "z"));
+  while (! q_keyed.empty()) {
+    cout << "[size = " << q_keyed.size() << ", top = " << q_keyed.top().name << "]";
+    for (keyed_fixed_size_priority_queue<Record, RecordScore>::iterator it = q_keyed.begin(); it != q_keyed.end(); it++) {
+      cout << "\t(" << it->name << ", " << it->score << ")";
+    }
+    cout << endl;
+    q_keyed.pop();
+  }
+
+  // A long stream with pops in between, so the cached threshold has to
+  // follow replacements and pops.
+  keyed_fixed_size_priority_queue<Record, RecordScore> q_stream(16);
+  for (int i = 0; i < 2000; ++i) {
+    q_stream.push(Record(i * 7919 % 1000, "s"));
+    if (i % 500 == 499)
+      q_stream.pop();
+  }
+  cout << "[stream: size = " << q_stream.size() << "]";
+  while (! q_stream.empty()) {
+    cout << "\t" << q_stream.top_key();
+    q_stream.pop();
+  }
+  cout << endl;
+  cout << endl;
+}
+
+template<typename Queue>
+void print_score_ids(Queue &q) {
+  while (! q.empty()) {
+    cout << "[size = " << q.size() << ", top = (" << q.top().first << ", " << q.top().second << ")]";
+    for (typename Queue::iterator it = q.begin(); it != q.end(); it++) {
+      cout << "\t(" << (*it).first << ", " << (*it).second << ")";
+    }
+    cout << endl;
+    q.pop();
+  }
+  cout << endl;
+}
+
+void test_packed() {
+  // The packed queue orders pairs like the generic one; -0 ties with 0.
+  typedef pair<float, uint32_t> ScoreId;
+  ScoreId xs[] = {ScoreId(-1.5f, 1), ScoreId(2.0f, 2), ScoreId(-0.5f, 3), ScoreId(7.0f, 4),
+                  ScoreId(-3.0f, 5), ScoreId(2.0f, 6), ScoreId(0.0f, 7), ScoreId(-0.0f, 8)};
+  packed_score_id_priority_queue q_packed(5);
+  fixed_size_priority_queue<ScoreId> q_pairs(5);
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i) {
+    q_packed.push(xs[i]);
+    q_pairs.push(xs[i]);
+  }
+  print_score_ids(q_packed);
+  print_score_ids(q_pairs);
+}
+
+void test_small() {
+  static_fixed_size_priority_queue<int, 4> q_small;
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_small.push(xs[i]);
+  do_test(q_small);
+
+  static_fixed_size_priority_queue<Foo, 3> q_small_complex;
+  q_small_complex.push(Foo(2, 3));
+  q_small_complex.push(Foo(3, 2));
+  q_small_complex.push(Foo(1, 5));
+  q_small_complex.push(Foo(5, 7));
+  do_test(q_small_complex);
+
+  // Empty slots hold null pointers the comparator must never see.
+  static_fixed_size_priority_queue<Foo*, 4, FooPointerCmp> q_small_pointer;
+  Foo foos[] = {Foo(2, 3), Foo(3, 2), Foo(1, 5), Foo(5, 7), Foo(5, 23), Foo(6, 3)};
+  for (size_t i = 0; i < sizeof(foos) / sizeof(foos[0]); ++i)
+    q_small_pointer.push(&foos[i]);
+  for (; !q_small_pointer.empty(); q_small_pointer.pop())
+    cout << "\t" << *q_small_pointer.top();
+  cout << endl;
+}
+
+void test_blocked() {
+  // 16 byte blocks hold subtrees of 3 ints, so 10 elements span 4 blocks.
+  blocked_fixed_size_priority_queue<int, less<int>, 16> q_blocked(10);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_blocked.push(xs[i]);
+  do_test(q_blocked);
+
+  // 128 byte blocks hold subtrees of 31 ints; a stream keeps the best 40.
+  blocked_fixed_size_priority_queue<int, less<int>, 128> q_stream(40);
+  for (int i = 0; i < 1000; ++i)
+    q_stream.push(i * 7919 % 1000);
+  for (; !q_stream.empty(); q_stream.pop())
+    cout << "\t" << q_stream.top();
+  cout << endl;
+}
+
+template<size_t Arity, size_t InlineCapacity>
+void stream_and_drain(const char *stream, bool rising) {
+  // 3000 distinct values; the best 128 are 2999 down to 2872.
+  fixed_size_priority_queue<int, less<int>, Arity, identity, InlineCapacity> q(128);
+  for (int i = 0; i < 3000; ++i)
+    q.push(rising ? i : i * 7919 % 3000);
+  cout << "[arity = " << Arity << ", inline = " << InlineCapacity << ", " << stream
+       << ": size = " << q.size() << "]";
+  int expected = 2999, wrong = 0;
+  for (size_t i = 0; !q.empty(); ++i, --expected, q.pop()) {
+    wrong += q.top() != expected;
+    if (i < 4)
+      cout << "\t" << q.top();
+  }
+  cout << "\t...\t" << expected + 1 << "\t[wrong = " << wrong << "]" << endl;
+}
+
+void test_arity() {
+  // Queues with enough leaves for the tournament tree; a rising stream
+  // replaces the minimum on every push.
+  stream_and_drain<2, 0>("scattered", false);
+  stream_and_drain<2, 0>("rising", true);
+  stream_and_drain<4, 0>("scattered", false);
+  stream_and_drain<4, 0>("rising", true);
+  stream_and_drain<8, 0>("scattered", false);
+  stream_and_drain<8, 0>("rising", true);
+  stream_and_drain<4, 8>("rising", true);
+  cout << endl;
+}
+
+void test_lazy() {
+  fixed_size_priority_queue<int> q_lazy(5);
+  q_lazy.set_lazy(true);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7, 3, 1, 9};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_lazy.push(xs[i]);
+  do_test(q_lazy);
+}
+
+void test_shrink() {
+  fixed_size_priority_queue<int> q_shrink(8);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_shrink.push(xs[i]);
+  vector<int> evicted;
+  q_shrink.shrink_max_size(3, back_inserter(evicted));
+  sort(evicted.begin(), evicted.end());
+  cout << "evicted:";
+  for (size_t i = 0; i < evicted.size(); ++i)
+    cout << "\t" << evicted[i];
+  cout << endl;
+  q_shrink.push(7);
+  q_shrink.push(10);
+  do_test(q_shrink);
+}
+
+void test_beam() {
+  fixed_size_priority_queue<float> q_beam(5);
+  q_beam.set_beam(3.0f);
+  float xs[] = {2, 3, 1, 5, 4.5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_beam.push(xs[i]);
+  do_test(q_beam);
+}
+
+void test_histogram() {
+  histogram_pruner<float> pruner(4, 0.5f);
+  float xs[] = {2, 3, 1, 5, 4.5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  pruner.push(xs, xs + sizeof(xs) / sizeof(xs[0]));
+  float cutoff = pruner.cutoff();
+  cout << "[cutoff = " << cutoff << ", bucket width = " << pruner.bucket_width() << "]";
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i) {
+    if (xs[i] >= cutoff)
+      cout << "\t" << xs[i];
+  }
+  cout << endl;
+
+  // No error bound: as many buckets as allowed.
+  histogram_pruner<float> exact_pruner(4, 0, 64);
+  exact_pruner.push(xs, xs + sizeof(xs) / sizeof(xs[0]));
+  cout << "[cutoff = " << exact_pruner.cutoff() << ", bucket width = "
+       << exact_pruner.bucket_width() << "]" << endl;
+
+  // Keeping no scores at all puts the cutoff above the highest one.
+  histogram_pruner<float> empty_pruner(0, 0.5f);
+  empty_pruner.push(xs, xs + sizeof(xs) / sizeof(xs[0]));
+  histogram_pruner<int> int_pruner(0, 1);
+  int ys[] = {2, 3, 1, 9};
+  int_pruner.push(ys, ys + sizeof(ys) / sizeof(ys[0]));
+  cout << "[max_active = 0: cutoff above 9 = " << (empty_pruner.cutoff() > 9)
+       << ", int cutoff = " << int_pruner.cutoff() << "]" << endl << endl;
+}
+
+void test_batched_argtopk() {
+  float scores[3][6] = {{2, 3, 1, 5, 5, 6},
+                        {2, 3, 1, 9, 4, 8},
+                        {0, 7, 3, 1, 9, 7}};
+  uint32_t ids[3][4];
+  float top_scores[3][4];
+  batched_argtopk(&scores[0][0], 3, 6, 4, &ids[0][0], &top_scores[0][0]);
+  for (size_t row = 0; row < 3; ++row) {
+    cout << "[row = " << row << "]";
+    for (size_t i = 0; i < 4; ++i)
+      cout << "\t" << ids[row][i] << ":" << top_scores[row][i];
+    cout << endl;
+  }
+
+  // Large enough for several threads, each with its queue in the scratch,
+  // and run twice so the second call reuses them.
+  size_t rows = 256, cols = 1024, k = 8;
+  vector<float> data(rows * cols);
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = static_cast<float>(i * 7919 % 4099);
+  vector<uint32_t> one_ids(rows * k), many_ids(rows * k);
+  vector<float> one_scores(rows * k), many_scores(rows * k);
+  batched_argtopk(data.data(), rows, cols, k, one_ids.data(), one_scores.data(), 1);
+  batched_argtopk_scratch scratch;
+  bool same = true;
+  for (int run = 0; run < 2; ++run) {
+    batched_argtopk(data.data(), rows, cols, k, many_ids.data(), many_scores.data(),
+                    scratch, 4);
+    same = same && one_ids == many_ids && one_scores == many_scores;
+  }
+  cout << "[rows = " << rows << ", threads = 4, same as 1 thread = " << same << "]"
+       << endl << endl;
+}
+
+void test_argtopk() {
+  vector<Record> records;
+  records.push_back(Record(2, "b"));
+  records.push_back(Record(3, "c"));
+  records.push_back(Record(1, "a"));
+  records.push_back(Record(5, "e"));
+  records.push_back(Record(3, "c2"));
+  records.push_back(Record(4, "d"));
+  vector<float> scores;
+  for (size_t i = 0; i < records.size(); ++i)
+    scores.push_back(records[i].score);
+  vector<uint32_t> ranked = argtopk(span<const float>(scores), 4);
+  cout << "[size = " << ranked.size() << "]";
+  for (size_t i = 0; i < ranked.size(); ++i)
+    cout << "\t" << ranked[i] << ":" << records[ranked[i]].name;
+  cout << endl << endl;
+}
+
+struct CountingRecordScore {
+  static int calls;
+  float operator() (const Record &r) const { ++calls; return r.score; }
+};
+int CountingRecordScore::calls = 0;
+
+void test_projection() {
+  fixed_size_priority_queue<Record, less<float>, 2, CountingRecordScore> q_projection(3);
+  float xs[] = {2, 3, 1, 5, 4.5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_projection.push(Record(xs[i], string(1, 'a' + i)));
+  while (! q_projection.empty()) {
+    cout << "[size = " << q_projection.size() << ", top = " << q_projection.top().name << "]";
+    for (fixed_size_priority_queue<Record, less<float>, 2, CountingRecordScore>::iterator it = q_projection.begin(); it != q_projection.end(); it++) {
+      cout << "\t(" << it->name << ", " << it->score << ")";
+    }
+    cout << endl;
+    q_projection.pop();
+  }
+  cout << "[projection calls = " << CountingRecordScore::calls << "]" << endl << endl;
+}
+
+struct Counted {
+  Counted(int v) : v(v) {}
+  Counted(const Counted &other) : v(other.v) { ++copies; }
+  Counted &operator=(const Counted &other) { v = other.v; ++copies; return *this; }
+  bool operator< (const Counted &other) const { return v < other.v; }
+  int v;
+  static int copies;
+};
+int Counted::copies = 0;
+
+struct CountedValue {
+  int operator() (const Counted &c) const { return c.v; }
+};
+
+void test_rejected_copies() {
+  // Elements that do not make it into a full queue are never copied.
+  fixed_size_priority_queue<Counted> q_identity(5);
+  fixed_size_priority_queue<Counted> q_lazy(5);
+  fixed_size_priority_queue<Counted, less<int>, 2, CountedValue> q_projection(5);
+  q_lazy.set_lazy(true);
+  for (int i = 0; i < 5; ++i) {
+    q_identity.push(Counted(1000 + i));
+    q_lazy.push(Counted(1000 + i));
+    q_projection.push(Counted(1000 + i));
+  }
+  q_lazy.top();
+  cout << "[copies =";
+  fixed_size_priority_queue<Counted> *qs[] = {&q_identity, &q_lazy};
+  for (size_t q = 0; q < 2; ++q) {
+    Counted::copies = 0;
+    for (int i = 0; i < 1000; ++i)
+      qs[q]->push(Counted(i));
+    cout << " " << Counted::copies;
+  }
+  Counted::copies = 0;
+  for (int i = 0; i < 1000; ++i)
+    q_projection.push(Counted(i));
+  cout << " " << Counted::copies << ", top = " << q_identity.top().v << ", "
+       << q_lazy.top().v << ", " << q_projection.top().v << "]" << endl << endl;
+}
+
+void test_stateful_compare() {
+  // Elements closest to a center have the highest priority.
+  int center = 4;
+  auto farther = [center](int a, int b) { return abs(a - center) > abs(b - center); };
+  fixed_size_priority_queue<int, decltype(farther)> q_stateful(4, farther);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_stateful.push(xs[i]);
+  do_test(q_stateful);
+}
+
+void test_grouped_top_k() {
+  // Top 3 scores per user, users seen in the order c, a, b.
+  grouped_top_k<string, int, 3> g;
+  const char *users[] = {"c", "a", "b", "a", "c", "a", "b", "a", "c", "a", "c"};
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    g.push(users[i], xs[i]);
+  for (size_t i = 0; i < g.size(); ++i) {
+    vector<int> ranked;
+    g.ranked(i, back_inserter(ranked));
+    cout << "[" << g.key(i) << ": size = " << g.group_size(i) << "]";
+    for (size_t j = 0; j < ranked.size(); ++j)
+      cout << "\t" << ranked[j];
+    cout << endl;
+  }
+  cout << "[find(b) = " << g.find("b") << ", find(d) = " << (g.find("d") == g.npos ? "npos" : "?") << "]" << endl;
+  g.clear();
+  g.push("d", 7);
+  cout << "[after clear: size = " << g.size() << ", find(d) = " << g.find("d")
+       << ", find(a) = " << (g.find("a") == g.npos ? "npos" : "?") << "]" << endl << endl;
+}
+
+void test_inline() {
+  // Up to 4 elements are stored inline, more spill to the heap.
+  fixed_size_priority_queue<int, less<int>, 2, identity, 4> q_inline(6);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    q_inline.push(xs[i]);
+  fixed_size_priority_queue<int, less<int>, 2, identity, 4> q_copy(q_inline);
+  do_test(q_inline);
+  q_copy.set_max_size(3);
+  do_test(q_copy);
+}
+
+void test_clear() {
+  // One queue reused across frames, and swapped with another.
+  fixed_size_priority_queue<int> q_frame(3), q_other(2);
+  int frames[][4] = {{2, 3, 1, 5}, {6, 2, 3, 1}};
+  for (size_t f = 0; f < 2; ++f) {
+    q_frame.clear();
+    for (size_t i = 0; i < 4; ++i)
+      q_frame.push(frames[f][i]);
+    print_queue(q_frame);
+  }
+  q_other.push(9);
+  swap(q_frame, q_other);
+  print_queue(q_frame);
+  print_queue(q_other);
+  cout << endl;
+}
+
+void test_pool() {
+  // Three queues of capacity 3, fed in one batch.
+  fixed_size_priority_queue_pool<int> pool(3, 3);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  int queues[] = {0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1};
+  pool.push(xs, xs + sizeof(xs) / sizeof(xs[0]), queues);
+  pool.pop(2);
+  for (size_t q = 0; q < pool.num_queues(); ++q) {
+    cout << "[queue " << q << ": size = " << pool.size(q) << ", top = " << pool.top(q) << "]";
+    vector<int> ranked;
+    pool.drain(q, back_inserter(ranked));
+    for (size_t i = 0; i < ranked.size(); ++i)
+      cout << "\t" << ranked[i];
+    cout << endl;
+  }
+
+  // Queues of capacity 0 own no storage at all.
+  fixed_size_priority_queue_pool<int> empty_pool(3, 0);
+  empty_pool.push(xs, xs + 3, queues);
+  empty_pool.pop(1);
+  vector<int> ranked;
+  empty_pool.drain(2, back_inserter(ranked));
+  cout << "[capacity 0: size = " << empty_pool.size(2) << ", drained = " << ranked.size() << "]"
+       << endl << endl;
+}
+
+void test_mpsc() {
+  // Four producers push 0 .. 39999 between them while the consumer drains.
+  mpsc_fixed_size_priority_queue<int> q_mpsc(5, 256);
+  atomic<int> producing(4);
+  vector<thread> producers;
+  for (int p = 0; p < 4; ++p) {
+    producers.push_back(thread([&q_mpsc, &producing, p]() {
+      for (int i = p; i < 40000; i += 4) {
+        while (!q_mpsc.push(i))
+          this_thread::yield();
+      }
+      --producing;
+    }));
+  }
+  while (producing > 0)
+    q_mpsc.drain(64);
+  for (size_t i = 0; i < producers.size(); ++i)
+    producers[i].join();
+  q_mpsc.drain();
+  cout << "[size = " << q_mpsc.size() << "]";
+  for (; !q_mpsc.empty(); q_mpsc.pop())
+    cout << "\t" << q_mpsc.top();
+  cout << endl;
+
+  // A pop makes room below the published threshold again.
+  for (int i = 10; i < 15; ++i)
+    q_mpsc.push(i);
+  q_mpsc.drain();
+  q_mpsc.pop();
+  q_mpsc.push(1);
+  q_mpsc.drain();
+  cout << "[size = " << q_mpsc.size() << "]";
+  for (; !q_mpsc.empty(); q_mpsc.pop())
+    cout << "\t" << q_mpsc.top();
+  cout << endl << endl;
+}
+
+void test_seqlock() {
+  // One writer pushes 0 .. 99999 while two readers check that every
+  // snapshot of the best three is intact: consecutive and best first.
+  seqlock_fixed_size_priority_queue<int, 3> q_seqlock(10);
+  atomic<bool> writing(true);
+  atomic<int> torn(0);
+  vector<thread> readers;
+  for (int r = 0; r < 2; ++r) {
+    readers.push_back(thread([&q_seqlock, &writing, &torn]() {
+      int best[3];
+      while (writing) {
+        size_t n = q_seqlock.top_n(best);
+        for (size_t i = 1; i < n; ++i)
+          torn += best[i] != best[i - 1] - 1;
+      }
+    }));
+  }
+  for (int i = 0; i < 100000; ++i)
+    q_seqlock.push(i);
+  writing = false;
+  for (size_t i = 0; i < readers.size(); ++i)
+    readers[i].join();
+  int best[3], top = -1;
+  size_t n = q_seqlock.top_n(best);
+  q_seqlock.top(top);
+  cout << "[torn = " << torn << ", top = " << top << "]";
+  for (size_t i = 0; i < n; ++i)
+    cout << "\t" << best[i];
+  cout << endl;
+
+  // Pushes and pops of scattered values, into queues smaller and larger
+  // than the three published elements, always publish the queue's best.
+  int mismatches = 0;
+  for (size_t max_size = 0; max_size <= 6; max_size += 2) {
+    seqlock_fixed_size_priority_queue<int, 3> q_mixed(max_size);
+    fixed_size_priority_queue<int> q_reference(max_size);
+    for (int i = 0; i < 1000; ++i) {
+      if (i % 7 == 3) {
+        q_mixed.pop();
+        q_reference.pop();
+      }
+      else {
+        q_mixed.push(i * 7919 % 1000);
+        q_reference.push(i * 7919 % 1000);
+      }
+      vector<int> expected(q_reference.begin(), q_reference.end());
+      sort(expected.rbegin(), expected.rend());
+      expected.resize(min<size_t>(expected.size(), 3));
+      n = q_mixed.top_n(best);
+      mismatches += vector<int>(best, best + n) != expected;
+    }
+  }
+  cout << "[mismatches = " << mismatches << "]" << endl << endl;
+}
+
+void test_snapshot() {
+  // One writer pushes 0 .. 99999 and publishes every 100 pushes, while two
+  // readers check that every snapshot holds consecutive elements.
+  snapshot_fixed_size_priority_queue<int> q_snapshot(10, 4);
+  atomic<bool> writing(true);
+  atomic<int> broken(0);
+  vector<thread> readers;
+  for (int r = 0; r < 2; ++r) {
+    readers.push_back(thread([&q_snapshot, &writing, &broken]() {
+      while (writing) {
+        snapshot_fixed_size_priority_queue<int>::snapshot s = q_snapshot.read();
+        if (s.empty())
+          continue;
+        int lowest = *min_element(s.begin(), s.end());
+        int highest = *max_element(s.begin(), s.end());
+        broken += highest - lowest != static_cast<int>(s.size()) - 1;
+      }
+    }));
+  }
+  for (int i = 0; i < 100000; ++i) {
+    q_snapshot.push(i);
+    if (i % 100 == 99)
+      q_snapshot.publish();
+  }
+  writing = false;
+  for (size_t i = 0; i < readers.size(); ++i)
+    readers[i].join();
+  snapshot_fixed_size_priority_queue<int>::snapshot s = q_snapshot.read();
+  vector<int> contents(s.begin(), s.end());
+  sort(contents.rbegin(), contents.rend());
+  cout << "[broken = " << broken << ", size = " << s.size() << "]";
+  for (size_t i = 0; i < contents.size(); ++i)
+    cout << "\t" << contents[i];
+  cout << endl << endl;
+}
+
+void test_multi() {
+  // 0 .. 99 spread over 4 shards; pops come out close to, not exactly in,
+  // descending order.
+  multi_fixed_size_priority_queue<int> q_multi(1000, 2, 2);
+  for (int i = 0; i < 100; ++i)
+    q_multi.push(i);
+  cout << "[shards = " << q_multi.num_shards() << ", size = " << q_multi.size() << "]";
+  int x, max_error = 0, sum = 0;
+  vector<bool> popped(100, false);
+  while (q_multi.try_pop(x)) {
+    popped[x] = true;
+    // Number of elements still queued that rank above x.
+    int error = 0;
+    for (int i = x + 1; i < 100; ++i)
+      error += !popped[i];
+    max_error = max(max_error, error);
+    sum += x;
+  }
+  cout << "\t[sum = " << sum << ", max rank error = " << max_error << "]" << endl << endl;
+}
+
+// Coroutine that starts right away and is never resumed after it finishes.
+struct detached_task {
+  struct promise_type {
+    detached_task get_return_object() { return detached_task(); }
+    suspend_never initial_suspend() { return suspend_never(); }
+    suspend_never final_suspend() noexcept { return suspend_never(); }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+};
+
+detached_task consume(async_fixed_size_priority_queue<int> &q) {
+  vector<int> batch = co_await q.next_batch(4);
+  cout << "[batch]";
+  for (size_t i = 0; i < batch.size(); ++i)
+    cout << "\t" << batch[i];
+  cout << endl;
+  async_fixed_size_priority_queue<int>::stream s = q.drain_async(3);
+  while (optional<int> x = co_await s.next())
+    cout << "[next = " << *x << "]" << endl;
+  cout << "[closed]" << endl << endl;
+}
+
+detached_task consume_batch(async_fixed_size_priority_queue<int> &q) {
+  vector<int> batch = co_await q.next_batch(3);
+  cout << "[batch of " << batch.size() << "]" << endl;
+}
+
+void test_async() {
+  async_fixed_size_priority_queue<int> q_async(3);
+  consume(q_async);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i) {
+    cout << "[push " << xs[i] << "]" << endl;
+    q_async.push(xs[i]);
+  }
+  q_async.flush();
+  q_async.close();
+
+  // A flush of an empty queue does not end the next batch early.
+  async_fixed_size_priority_queue<int> q_flushed(3);
+  consume_batch(q_flushed);
+  q_flushed.flush();
+  for (int i = 1; i <= 3; ++i) {
+    cout << "[push " << i << "]" << endl;
+    q_flushed.push(i);
+  }
+  cout << endl;
+}
+
+void test_reservoir() {
+  // Items 0 .. 3 with weights 1 .. 4 are sampled with probabilities
+  // 0.1 .. 0.4, one at a time, and more evenly three at a time.
+  const char *items[] = {"a", "b", "c", "d"};
+  double weights[] = {1, 2, 3, 4};
+  int ones[4] = {0}, threes[4] = {0}, runs = 20000;
+  weighted_reservoir<int, 1> one;
+  weighted_reservoir<int, 3> three;
+  for (int r = 0; r < runs; ++r) {
+    one.clear();
+    three.clear();
+    for (int i = 0; i < 4; ++i) {
+      one.push(i, weights[i]);
+      three.push(i, weights[i]);
+    }
+    int picked[3];
+    one.sample(picked);
+    ++ones[picked[0]];
+    int *end = three.sample(picked);
+    for (int *p = picked; p != end; ++p)
+      ++threes[*p];
+  }
+  cout.precision(1);
+  cout << fixed;
+  for (int i = 0; i < 4; ++i)
+    cout << "[" << items[i] << ": " << double(ones[i]) / runs << ", " << double(threes[i]) / runs << "]\t";
+  cout.unsetf(ios::fixed);
+  cout.precision(6);
+  cout << endl << endl;
+}
+
+void test_running_quantile() {
+  // Median and p90 of the last 5 values.
+  running_quantile<int> median(5, 0.5), p90(5, 0.9);
+  int xs[] = {2, 3, 1, 5, 5, 6, 2, 3, 1, 9, 4, 8, 0, 7};
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i) {
+    median.push(xs[i]);
+    p90.push(xs[i]);
+    cout << "[push " << xs[i] << ": size = " << median.size() << ", median = "
+         << median.quantile() << ", p90 = " << p90.quantile() << "]" << endl;
+  }
+
+  // Out of range quantiles are clamped to the minimum and the maximum.
+  running_quantile<int> below(5, -1), above(5, 2);
+  for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i) {
+    below.push(xs[i]);
+    above.push(xs[i]);
+  }
+  cout << "[q = -1: " << below.quantile() << ", q = 2: " << above.quantile() << "]" << endl << endl;
+}
+
+void test_decayed() {
+  // Scores halve every 10 time units.
+  decayed_fixed_size_priority_queue<string> q_decayed(3, 10);
+  const char *names[] = {"old", "mid", "new", "small", "late"};
+  double scores[] = {100, 30, 20, 5, 1};
+  double times[] = {0, 20, 30, 30, 10000};
+  for (size_t i = 0; i < 5; ++i) {
+    q_decayed.push(names[i], scores[i], times[i]);
+    cout << "[push " << names[i] << " at " << times[i] << ": top = " << q_decayed.top()
+         << ", score = " << q_decayed.top_score(times[i]) << ", landmark = "
+         << q_decayed.landmark() << "]" << endl;
+  }
+  while (!q_decayed.empty()) {
+    cout << "\t(" << q_decayed.top() << ", " << q_decayed.top_score(10000) << ")";
+    q_decayed.pop();
+  }
+  cout << endl << endl;
+}
+
 int main(int argc, char const *argv[]) {
   test_simple();
   test_complex();
   test_pointer();
+  test_keyed();
+  test_packed();
+  test_small();
+  test_blocked();
+  test_arity();
+  test_lazy();
+  test_shrink();
+  test_beam();
+  test_histogram();
+  test_batched_argtopk();
+  test_argtopk();
+  test_projection();
+  test_rejected_copies();
+  test_stateful_compare();
+  test_grouped_top_k();
+  test_inline();
+  test_clear();
+  test_pool();
+  test_mpsc();
+  test_seqlock();
+  test_snapshot();
+  test_multi();
+  test_async();
+  test_reservoir();
+  test_running_quantile();
+  test_decayed();
 }
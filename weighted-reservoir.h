@@ -0,0 +1,186 @@
+// Copyright 2016  Junbo Zhang
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef WEIGHTED_RESERVOIR_H_
+#define WEIGHTED_RESERVOIR_H_
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <stdint.h>
+
+#include "fixed-size-priority-queue.h"
+
+namespace fspq_detail {
+
+/// An item of a reservoir with its key log(u) / w.
+template<typename T>
+struct reservoir_entry
+{
+  double key;
+  T item;
+};
+
+struct reservoir_key_less
+{
+  template<typename T>
+  bool operator()(const reservoir_entry<T> &a, const reservoir_entry<T> &b) const {
+    return a.key < b.key;
+  }
+};
+
+}  // namespace fspq_detail
+
+/// Weighted random sampling without replacement of K items from a stream:
+/// item i ends up in the sample as if it got the key u_i^(1 / w_i), with u_i
+/// uniform in (0, 1), and the K largest keys were kept.
+///
+/// The keys are kept as log(u) / w, which does not underflow for large
+/// weights, in a fixed_size_priority_queue whose bottom() is the threshold.
+/// Instead of drawing a key for every item, exponential jumps (A-ExpJ) draw
+/// how much weight passes before the next item that enters the sample, so
+/// the items in between cost a subtraction each. Reservoirs of up to 64
+/// items are stored inline.
+template<typename T, size_t K>
+class weighted_reservoir
+{
+    typedef fspq_detail::reservoir_entry<T> entry;
+    static const size_t inline_capacity = K <= 64 ? K : 0;
+    typedef fixed_size_priority_queue<entry, fspq_detail::reservoir_key_less, 2,
+                                      std::identity, inline_capacity> queue_type;
+
+  public:
+    explicit weighted_reservoir(uint64_t seed = 0x853c49e6748fea9bull)
+        : q_(K), state_(seed | 1), skip_(0) {}
+
+    /// Offers x with weight w. Items with a weight that is not positive are
+    /// never sampled.
+    inline void push(const T &x, double w) {
+      if (!(w > 0))
+        return;
+      if (q_.size() < K) {
+        entry e = { std::log(uniform()) / w, x };
+        q_.push(e);
+        if (q_.size() == K)
+          jump();
+        return;
+      }
+      skip_ -= w;
+      if (skip_ > 0)
+        return;
+      // x enters with a key above the threshold t: u is uniform in (t^w, 1).
+      double threshold = q_.bottom().key;
+      double low = std::exp(threshold * w);
+      entry e = { std::log(low + (1 - low) * uniform()) / w, x };
+      q_.push(e);
+      jump();
+    }
+
+    /// Offers the items of [first, last) with the weights from weights on.
+    /// With random access iterators, whole blocks of items that the next
+    /// jump passes over are skipped on the sum of their weights.
+    template<typename InputIterator, typename WeightIterator>
+    void push(InputIterator first, InputIterator last, WeightIterator weights) {
+      for (; first != last && q_.size() < K; ++first, ++weights)
+        push(*first, *weights);
+      push_skipping(first, last, weights,
+                    typename std::iterator_traits<InputIterator>::iterator_category(),
+                    typename std::iterator_traits<WeightIterator>::iterator_category());
+    }
+
+    /// Writes the sampled items to out, in no particular order.
+    template<typename OutputIterator>
+    OutputIterator sample(OutputIterator out) {
+      for (typename queue_type::iterator it = q_.begin(); it != q_.end(); ++it)
+        *out++ = it->item;
+      return out;
+    }
+
+    inline const size_t size() const {
+      return q_.size();
+    }
+
+    inline const bool empty() const {
+      return q_.empty();
+    }
+
+    /// Starts a new sample, keeping the random state.
+    inline void clear() {
+      q_.clear();
+      skip_ = 0;
+    }
+
+  protected:
+    static const size_t skip_block = 16;
+
+    template<typename InputIterator, typename WeightIterator, typename Tag1, typename Tag2>
+    void push_skipping(InputIterator first, InputIterator last, WeightIterator weights,
+                       Tag1, Tag2) {
+      for (; first != last; ++first, ++weights) {
+        double w = *weights;
+        if (w > 0 && (skip_ -= w) <= 0) {
+          skip_ += w;
+          push(*first, w);
+        }
+      }
+    }
+
+    template<typename InputIterator, typename WeightIterator>
+    void push_skipping(InputIterator first, InputIterator last, WeightIterator weights,
+                       std::random_access_iterator_tag, std::random_access_iterator_tag) {
+      while (last - first >= static_cast<ptrdiff_t>(skip_block)) {
+        // Four independent partial sums, which compilers vectorize.
+        double sums[4] = {0, 0, 0, 0};
+        for (size_t b = 0; b < skip_block; b += 4) {
+          for (size_t j = 0; j < 4; ++j)
+            sums[j] += std::max<double>(weights[b + j], 0);
+        }
+        double sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+        if (sum < skip_) {
+          skip_ -= sum;
+        }
+        else {
+          push_skipping(first, first + skip_block, weights,
+                        std::input_iterator_tag(), std::input_iterator_tag());
+        }
+        first += skip_block;
+        weights += skip_block;
+      }
+      push_skipping(first, last, weights, std::input_iterator_tag(), std::input_iterator_tag());
+    }
+
+    /// Draws the weight to pass before the next item enters the sample.
+    inline void jump() {
+      skip_ = std::log(uniform()) / q_.bottom().key;
+    }
+
+    /// Uniform in (0, 1), from xorshift64*.
+    inline double uniform() {
+      state_ ^= state_ >> 12;
+      state_ ^= state_ << 25;
+      state_ ^= state_ >> 27;
+      uint64_t bits = (state_ * 0x2545f4914f6cdd1dull) >> 11;
+      return (bits + 0.5) * (1.0 / 9007199254740992.0);
+    }
+
+    queue_type q_;
+    uint64_t state_;
+    // Weight still to pass before the next item enters.
+    double skip_;
+
+    static_assert(K > 0, "an empty sample needs no reservoir");
+};
+
+#endif  // WEIGHTED_RESERVOIR_H_